@@ -5,6 +5,14 @@ if [ $# -lt 1 ]; then
 	echo "cmd: add / del <path to device> <shelf> <slot> [interface]"
 	echo "cmd: hostmask <shelf> <slot> <mac address>"
 	echo "cmd: rmmask   <shelf> <slot> <mac address>"
+	echo "cmd: set      <shelf> <slot> qdepth <number of requests>"
+	echo "cmd: set      <shelf> <slot> cpus <cpu list> | local | rx"
+	echo "cmd: set      <shelf> <slot> wcache off | through | back"
+	echo "cmd: set      <shelf> <slot> readahead <kbytes>"
+	echo "cmd: set      <shelf> <slot> direct on|off"
+	echo "cmd: set      <shelf> <slot> flushwindow <usecs>"
+	echo "cmd: set      <shelf> <slot> async <kbytes>"
+	echo "cmd: ifset    <interface> xmit direct | queue"
 	exit 1
 fi
 
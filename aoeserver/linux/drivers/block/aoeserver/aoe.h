@@ -14,14 +14,26 @@
   */
 
  /* 
-  * Definitions for the ATA over Ethernet protocol.
+  * Definitions shared by the parts of the aoeserver module, the protocol
+  * itself is defined in aoeproto.h.
   */
 
-
-#define PRIV_ETH_P_AOE 0x88A2
-
-#include <linux/workqueue.h> /* work_struct */
 #include <linux/if_ether.h>	/* eth-struct used in aoe-header */
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/mempool.h>
+#include <linux/cpumask.h>
+#include <linux/seqlock.h>
+#include <linux/ktime.h>
+#include <linux/cache.h>
+#include <linux/marker.h>
+#include <linux/workqueue.h>
+#include <linux/fs.h>
+#include <asm/local.h>
+
+#include "aoeproto.h"
 
 /* Valid commands for aoeproc.c */
 #define CMDEINVAL   ((int)( -1))
@@ -29,57 +41,15 @@
 #define CMDUNREG    ((int)(  1))
 #define CMDHOSTMASK ((int)(  3))
 #define CMDRMMASK   ((int)(  4))
+#define CMDSET      ((int)(  5))
+#define CMDIFSET    ((int)(  6))
 
-/* Bit field in ver_flags of aoe-header */
-#define AOE_FLAG_RSP (1<<3)
-#define AOE_FLAG_ERR (1<<2)
-
-/* Error codes for the error field in the aoe header */
-#define AOE_ERR_BADCMD       1	/* Unrecognized command code */
-#define AOE_ERR_BADARG       2	/* Bad argument parameter */
-#define AOE_ERR_DEVUNAVAIL   3	/* Device unavailable */
-#define AOE_ERR_CFG_SET      4	/* Config string present */
-#define AOE_ERR_UNSUPVER     5	/* Unsupported version */
-
-/* Commands in cmd-field of aoe-header */
-#define AOE_CMD_ATA 0
-#define AOE_CMD_CFG 1
-
-struct aoe_hdr {
-	struct ethhdr eth;   /* ethernet header, see linux/if_ether.h */
-	u8 ver_flags;	     /* bit field: 7-4 ver, 3 rsp, 2 error, 0&1 zero */
-	u8 error;	     /* If error bit is set, fill out this field */
-	u16 shelf;
-	u8 slot;
-	u8 cmd;		     /* ATA or CFG */
-	u32 tag;	     /* Uniqueue request tag */
-} __attribute__ ((packed));
-
-#define MAXATALBA (int)(0x0fffffff)
-
-/* Bitfields for the flags field in the aoe ata header */
-#define AOE_ATAFLAG_LBA48 (1 << 6)
-#define AOE_ATAFLAG_ASYNC (1 << 1)
-#define AOE_ATAFLAG_WRITE (1 << 0)
-
-struct aoe_atahdr {
-	u8 flags;		/* bitfield: 7 zero, 6 LBA48, 5 zero
-				 * 4 Device/head, 3 zero, 2 zero, 
-				 * 1 Async IO, 0 Read/Write */
-	u8 err_feature;		/* Check linux/hdreg.h for status codes */
-	u8 nsect;		/* Number of sectors to transfer */
-	u8 cmdstat;		/* cmd in request and status in reply */
-	u8 lba[6];		/* 48bit LBA addressing */
-	u8 notused[2];		/* reserved */
-} __attribute__ ((packed));
-
-struct aoe_cfghdr {
-	u16 queuelen;		/* The number of requests we can queue */
-	u16 firmware;		/* Firmware version */
-	u8 notused;		/* Reserved field */
-	u8 aoever_cmd;		/* bit field: 7-4 aoe-version, 3 - 0 cmd */
-	u16 data_len;		/* data length */
-} __attribute__ ((packed));
+/* Number of requests we queue per device unless told otherwise */
+#define AOE_DEFQDEPTH 20
+#define AOE_MAXQDEPTH 1024
+
+/* Devices a kaoed pass keeps plugged until the pass is over */
+#define AOE_PLUGMAX 8
 
 /* List of hosts allowed to see this device */
 struct accesslist {
@@ -87,28 +57,210 @@ struct accesslist {
 	unsigned char h_source[ETH_ALEN];
 };
 
+/* Kernel markers along the way of a request, h is the aoe-header of the
+ * request or the reply. The arguments are only evaluated when a probe is
+ * connected to the marker. See tools/aoetrace.stp for a consumer. */
+#define aoe_trace(name, h)						\
+	trace_mark(name, "shelf %u slot %u tag %u lba %llu nsect %u",	\
+		   (unsigned int)ntohs((h)->shelf), (unsigned int)(h)->slot, \
+		   (unsigned int)ntohl((h)->tag),			\
+		   (h)->cmd == AOE_CMD_ATA ? (unsigned long long)	\
+		   aoeproto_lba((struct aoe_atahdr *)((h) + 1)) : 0ULL, \
+		   (h)->cmd == AOE_CMD_ATA ? (unsigned int)		\
+		   ((struct aoe_atahdr *)((h) + 1))->nsect : 0U)
+
+/* Counters kept per device and per interface, see aoestats.c */
+enum {
+	AOESTAT_RX,		/* Frames recieved */
+	AOESTAT_DROP,		/* Frames dropped without a reply */
+	AOESTAT_TX,		/* Replies sent */
+	AOESTAT_READ,		/* Bytes read */
+	AOESTAT_WRITE,		/* Bytes written */
+	AOESTAT_QFULL,		/* Frames dropped because the queue was full */
+	AOESTAT_NOMEM,		/* Frames dropped for lack of memory */
+	AOESTAT_ACL,		/* Requests rejected by the access list */
+	AOESTAT_RANGE,		/* Requests beyond the end of the device */
+	AOESTAT_IOERR,		/* Reads and writes that failed */
+	AOESTAT_SHORT,		/* ... of which were short */
+	AOESTAT_WCWRITE,	/* Writes gathered by the write cache */
+	AOESTAT_WCFLUSH,	/* Writes of gathered extents */
+	AOESTAT_RAHIT,		/* Stream reads found in the page cache */
+	AOESTAT_RAMISS,		/* Stream reads that were not */
+	AOESTAT_DUPDROP,	/* Retransmits of requests in flight, dropped */
+	AOESTAT_DUPREPLAY,	/* Retransmits answered with a kept reply */
+	AOESTAT_UNALIGNED,	/* Direct requests that used the page cache */
+	AOESTAT_BIO,		/* Bios submitted */
+	AOESTAT_UNPLUG,		/* Queue unplugs after a kaoed pass */
+	AOESTAT_FLUSHREQ,	/* Flush cache commands and fua writes */
+	AOESTAT_FLUSH,		/* Flushes of the backing device */
+	AOESTAT_ASYNC,		/* Async writes acknowledged early */
+	AOESTAT_ASYNCFULL,	/* Async writes done in place, buffer full */
+	AOESTAT_MAX
+};
+
+/* Latency histograms, in microseconds */
+enum {
+	AOEHIST_QUEUE,		/* Recieved until picked up by kaoed */
+	AOEHIST_IO,		/* Time spent reading or writing */
+	AOEHIST_TOTAL,		/* Recieved until the reply is sent */
+	AOEHIST_FLUSH,		/* Time spent flushing the backing device */
+	AOEHIST_DRAIN,		/* Async write acknowledged until written */
+	AOEHIST_MAX
+};
+
+/* Bucket n counts latencies up to 2^n us, the last one everything above */
+#define AOE_HISTBUCKETS 16
+
+/* One of these per cpu, they are only ever updated by their own cpu */
+struct aoestats {
+	local_t count[AOESTAT_MAX];
+	local_t hist[AOEHIST_MAX][AOE_HISTBUCKETS];
+	local_t histsum[AOEHIST_MAX];
+} ____cacheline_aligned_in_smp;
+
+/* Write cache modes, see aoecache.c */
+#define AOE_WC_OFF	0
+#define AOE_WC_THROUGH	1	/* Reply once the gathered write is done */
+#define AOE_WC_BACK	2	/* Reply as soon as the write is gathered */
+
+/* Largest extent the write cache gathers, and for how long */
+#define AOE_WC_MAXSECT 256
+#define AOE_WC_WINDOW (HZ / 500 ? HZ / 500 : 1)
+
+struct aoecache {
+	struct mutex lock;	/* Protects everything below */
+	int mode;
+	char *buf;		/* AOE_WC_MAXSECT sectors, unless off */
+	u64 lba;		/* First sector gathered in buf */
+	unsigned int nsect;	/* Number of sectors gathered */
+	struct list_head held;	/* Write-through requests waiting for buf */
+	int error;		/* Write-back failure not yet reported */
+	struct delayed_work work;	/* Ends the window */
+};
+
+/* Sequential read streams we keep track of per device, see aoestream.c */
+#define AOE_RA_STREAMS 16
+#define AOE_RA_SLACK 256	/* Sectors a read may be away from the stream */
+#define AOE_RA_MIN 2		/* Reads that continue a stream before we act */
+#define AOE_RA_DEFAULT (512 * 1024)	/* Default read-ahead window, bytes */
+#define AOE_RA_MAX (16 * 1024 * 1024)
+
+struct aoestream {
+	unsigned char h_source[ETH_ALEN];	/* Who is reading */
+	u64 next;		/* Sector after the furthest read */
+	int seq;		/* Reads that continued the stream */
+	unsigned long used;	/* jiffies of the last read, 0 if unused */
+	struct file_ra_state ra;
+};
+
+/* Hash of requests in flight and kept replies, see aoetag.c */
+#define AOE_TAG_BITS 6
+#define AOE_TAG_HASH (1 << AOE_TAG_BITS)
+
+/* How long, and how many, replies are kept for retransmits */
+#define AOE_REPLAY_TIME (HZ / 2)
+#define AOE_REPLAY_MAX 64
+
+/* Group commit of flushes, see aoeflush.c */
+#define AOE_FLUSH_MAXWINDOW 100000	/* Usecs */
+
+struct aoeflush {
+	spinlock_t lock;	/* Protects waiting */
+	struct list_head waiting;	/* Requests for the next flush */
+	struct work_struct work;	/* Runs on aoe_flushwq */
+	unsigned int window;	/* Usecs to wait for more flushes */
+};
+
+/* Buffer for early acknowledged writes, see aoeasync.c */
+#define AOE_ASYNC_DEFAULT (1024 * 1024)	/* Bytes */
+#define AOE_ASYNC_MAX (64 * 1024 * 1024)
+
+struct aoeasync {
+	spinlock_t lock;	/* Protects everything below */
+	struct list_head queue;	/* Writes to drain, oldest first */
+	unsigned long bytes;	/* Data held in queue */
+	unsigned long max;	/* Most data we hold, 0 for none */
+	int draining;		/* The drain is running or scheduled */
+	int error;		/* Failed drain not yet reported */
+	struct work_struct work;	/* Drains the queue */
+	wait_queue_head_t wait;	/* Woken when a write has been drained */
+};
+
 struct aoeblkdev {
 	struct list_head list;	/* see linux/list.h */
+	struct hlist_node hash;	/* entry in the shelf/slot hash */
 	struct file *fp;	/* Pointer to open device */
+	struct block_device *bdev;	/* Set if fp is a block device */
+	int direct;		/* Keep out of the page cache */
 	u8 name[32];		/* Name of the open device */
 	int ifindex;	    /* if (>1) We only accept traffic on this device */
-	u8 cfg_data[1024];	/* Config data */
+	spinlock_t tmpl_lock;	/* Protects cfg, cfg_len and id */
+	struct aoe_cfgtmpl cfg;	/* Config reply, string and all */
 	u16 cfg_len;		/* Lenght of config data */
-	u64 size;		/* size of the device */
+	u8 id[512];		/* Identify reply data */
+	seqcount_t size_seq;	/* Lets aoeblock_size() read size locklessly */
+	u64 size;		/* size of the device in sectors */
 	u16 shelf;
 	u8 slot;
 	rwlock_t acl_lock;	/* lock for accessing the access list */
 	struct accesslist *acl;	/* Access list for this device */
-	struct workqueue_struct *kaoed_wq;  /* Each device has its own wq */
-	atomic_t queuecounter;	/* How many packets that are currently in the queue */
+	atomic_t queuecounter;	/* Packets in the queue, plus one held until
+				 * aoewq_exit() */
+	int qdepth;		/* Max queued packets, advertised as buffer count */
+	mempool_t *reqpool;	/* qdepth preallocated struct aoerequest */
+	struct aoestats *stats;	/* Per cpu counters */
+	struct completion qdone;	/* Completed when the queue has drained
+					 * in aoewq_exit() */
+	cpumask_t cpus;		/* Cpus to handle requests on, empty for any */
+	struct aoecache wc;	/* Write cache */
+	struct mutex ra_lock;	/* Protects ra_pages and streams */
+	unsigned long ra_pages;	/* Read-ahead window, 0 for none */
+	struct aoestream streams[AOE_RA_STREAMS];
+	struct aoeflush fl;	/* Group commit */
+	struct aoeasync as;	/* Early acknowledged writes */
+	spinlock_t tag_lock;	/* Protects everything below */
+	struct hlist_head inflight[AOE_TAG_HASH];	/* Ata requests */
+	struct hlist_head replays[AOE_TAG_HASH];	/* Kept replies */
+	struct list_head replay_lru;	/* Kept replies, oldest first */
+	int nreplay;
+};
+
+/* How often we look for exported devices that have changed size */
+#define AOE_RESIZE_INTERVAL (5 * HZ)
+
+/* Number of initiators per interface we remember discovery queries from */
+#define AOE_DISC_HASH 64
+
+/* Min time between two discovery queries we answer from one initiator */
+#define AOE_DISC_INTERVAL (HZ / 10)
+
+/* Settings for a network interface */
+struct aoeif {
+	struct list_head list;
+	int ifindex;
+	int direct;		/* Send replies without going through the qdisc */
+	struct aoestats *stats;	/* Per cpu counters, NULL until allocated */
+
+	/* Broadcast config queries are answered by aoenet_discover() */
+	spinlock_t lock;	/* Protects everything below */
+	int gen;		/* aoenet_changed() count replies were built at */
+	unsigned int mtu;	/* mtu replies were built for */
+	struct sk_buff_head replies;	/* Config reply for each device */
+	struct {
+		unsigned char h_source[ETH_ALEN];
+		unsigned long when;
+	} seen[AOE_DISC_HASH];	/* Last query answered per initiator */
 };
 
 /* struct used to queue work with the kaoed thread and kernel block io */
 struct aoerequest {
-	struct work_struct work;	/* struct used for work-queues */
+	struct list_head list;	/* Entry in the queue of a kaoed thread */
+	void (*fn)(struct aoerequest *);	/* What kaoed should do with it */
+	int cpu;		/* The kaoed thread handling this request */
 	struct sk_buff *skb_req;	/* pointer to the original request */
 	struct sk_buff *skb_rep;	/* pointer to our reply */
 	struct net_device *ifp;	/* interface that the request came in on */
+	struct aoeif *aif;	/* and its settings, may be NULL */
 
 	/* pointers into the skb-structs */
 	struct aoe_hdr *aoereq;
@@ -119,15 +271,38 @@ struct aoerequest {
 
 	/* Pointer to the block device to tranfser to/from */
 	struct aoeblkdev *abd;
+
+	struct hlist_node tagnode;	/* Entry in the requests in flight */
+	int tagged;		/* Set while in the requests in flight */
+	int retried;		/* A retransmit of it has been dropped */
+
+	/* What the request is checked against, read once by create_skb()
+	 * so that the reply is sized for what handleata() decides */
+	u64 size;		/* Size of the device in sectors */
+	int maxsect;		/* Sectors that fit in a frame */
+
+	int error;		/* Set by bldev_endio() if the bio failed */
+	int zerocopy;		/* Read data is attached as page fragments */
+
+	ktime_t t_rx;		/* When the request was recieved */
+	ktime_t t_io;		/* When io was started, zero if it wasnt */
 };
 
 /* aoenet.c */
 int aoenet_init(void);
 void aoenet_exit(void);
+int aoenet_maxsect(struct net_device *ifp);
+int aoenet_setxmit(int ifindex, int direct);
+void aoenet_xmit(struct sk_buff_head *q);
+void aoenet_ifexit(void);
+void aoenet_changed(void);
+struct seq_file;
+void aoenet_seq_show(struct seq_file *s);
+void aoenet_stats_show(struct seq_file *s);
 /* end aoenet.c */
 
 /* aoepacket.c */
-void kaoed(struct work_struct *data);
+void kaoed(struct aoerequest *work);
 void aoepacket(struct aoerequest *work);
 void handleata(struct aoerequest *work);
 void handleconfig(struct aoerequest *work);
@@ -139,28 +314,129 @@ void aoexmit(struct aoerequest *work);
 int aoeblock_init(void);
 void aoeblock_exit(void);
 int bldev_transfer(struct aoerequest *work);
+int bldev_flush(struct aoerequest *work);
+void bldev_status(struct aoerequest *work, ssize_t ret, unsigned int len);
 int bldev_identify(struct aoerequest *work);
-int aoeblock_register(char *device, int major, int minor, int ifindex);
-int aoeblock_unregister(char *device, int major, int minor, int ifindex);
-struct aoeblkdev *find_aoedevice(int major, int minor, int ifindex);
+void bldev_buildid(struct aoeblkdev *abd);
+void bldev_buildcfg(struct aoeblkdev *abd);
+u64 aoeblock_size(struct aoeblkdev *abd);
+int bldev_zerocopy(struct aoerequest *work);
+int bldev_dropbehind(struct aoeblkdev *abd, loff_t ppos, unsigned int len,
+		     int write);
+void bldev_unplug(struct aoeblkdev *abd);
+int bldev_sync(struct aoeblkdev *abd);
+ssize_t bldev_write_wait(struct aoeblkdev *abd, struct sk_buff *skb,
+			 unsigned int offset, unsigned int len, loff_t ppos);
+ssize_t bldev_write_buf(struct aoeblkdev *abd, char *buf, unsigned int len,
+			loff_t ppos);
+int aoeblock_register(char *device, int shelf, int slot, int ifindex);
+int aoeblock_unregister(char *device, int shelf, int slot, int ifindex);
+struct aoeblkdev *find_aoedevice(int shelf, int slot, int ifindex);
 int aoeblock_mask(unsigned short shelf, unsigned short slot,
 		  unsigned char *h_source);
 int aoeblock_rmmask(unsigned short shelf, unsigned short slot,
 		    unsigned char *h_source);
 int aoeblock_acl(struct aoeblkdev *abd, unsigned char *h_source);
+int aoeblock_setqdepth(unsigned short shelf, unsigned short slot, int qdepth);
+int aoeblock_setcpus(unsigned short shelf, unsigned short slot, char *cpus);
+int aoeblock_setwcache(unsigned short shelf, unsigned short slot, char *mode);
+int aoeblock_setreadahead(unsigned short shelf, unsigned short slot,
+			  unsigned long kb);
+int aoeblock_setdirect(unsigned short shelf, unsigned short slot, char *mode);
+int aoeblock_setflushwindow(unsigned short shelf, unsigned short slot,
+			    unsigned int usecs);
+int aoeblock_setasync(unsigned short shelf, unsigned short slot,
+		      unsigned long kb);
+extern struct list_head abd_list;
+extern struct mutex abd_mutex;
 /* end aoeblock.c */
 
 /* aoewq.c */
+int aoewq_cacheinit(void);
+void aoewq_cacheexit(void);
+int aoewq_resize(struct aoeblkdev *abd, int qdepth);
+int aoewq_startworkers(void);
+void aoewq_stopworkers(void);
+int aoewq_startqueues(void);
+void aoewq_stopqueues(void);
+void aoewq_queue(struct aoerequest *work, void (*fn)(struct aoerequest *));
+int aoewq_xmit(struct sk_buff *skb);
+int aoewq_plug(struct aoeblkdev *abd);
 void aoewq_init(struct aoeblkdev *abd);
 void aoewq_exit(struct aoeblkdev *abd);
 void aoewq_addreq(struct sk_buff *skb, struct net_device *ifp,
-		  struct aoeblkdev *abd);
-int submit_work(struct aoerequest *workreq, int type);
+		  struct aoeif *aif, struct aoeblkdev *abd);
 void aoereq_destroy(struct aoerequest *work);
 void aoedecqueue(struct aoeblkdev *abd);
 int aoecheckqueue(struct aoeblkdev *abd);
+extern struct workqueue_struct *aoe_flushwq;
+extern struct workqueue_struct *aoe_iowq;
 /* end aoewq.c */
 
+/* aoeskb.c */
+struct sk_buff *aoeskb_alloc(struct net_device *dev, unsigned int len);
+void aoeskb_recycle(struct sk_buff *skb);
+void aoeskb_xmit(struct aoerequest *work);
+void aoeskb_exit(void);
+/* end aoeskb.c */
+
+/* aoestats.c */
+struct aoestats *aoestats_alloc(void);
+void aoestats_free(struct aoestats *st);
+void aoestats_add(struct aoestats *st, int what, long n);
+void aoestats_inc(struct aoerequest *work, int what);
+void aoestats_hist(struct aoestats *st, int which, ktime_t start, ktime_t end);
+void aoestats_reply(struct aoerequest *work);
+unsigned long aoestats_sum(struct aoestats *st, int what);
+void aoestats_show(struct seq_file *s, const char *prefix,
+		   struct aoestats *st);
+int aoestats_init(void);
+void aoestats_exit(void);
+/* end aoestats.c */
+
+/* aoecache.c */
+void aoecache_init(struct aoeblkdev *abd);
+void aoecache_exit(struct aoeblkdev *abd);
+int aoecache_setmode(struct aoeblkdev *abd, int mode);
+int aoecache_write(struct aoerequest *work, unsigned int offset,
+		   unsigned int len, u64 lba);
+void aoecache_read(struct aoeblkdev *abd, u64 lba, unsigned int nsect);
+int aoecache_flush(struct aoeblkdev *abd);
+/* end aoecache.c */
+
+/* aoestream.c */
+void aoestream_init(struct aoeblkdev *abd);
+void aoestream_read(struct aoerequest *work, loff_t ppos, unsigned int len);
+void aoestream_setra(struct aoeblkdev *abd, unsigned long pages);
+int aoestream_count(struct aoeblkdev *abd);
+/* end aoestream.c */
+
+/* aoetag.c */
+void aoetag_init(struct aoeblkdev *abd);
+void aoetag_exit(struct aoeblkdev *abd);
+int aoetag_dup(struct aoeblkdev *abd, struct sk_buff *req,
+	       struct net_device *ifp, struct aoeif *aif);
+int aoetag_add(struct aoerequest *work);
+void aoetag_del(struct aoerequest *work);
+void aoetag_keep(struct aoerequest *work);
+/* end aoetag.c */
+
+/* aoeflush.c */
+void aoeflush_init(struct aoeblkdev *abd);
+void aoeflush_request(struct aoerequest *work);
+void aoeflush_exit(struct aoeblkdev *abd);
+/* end aoeflush.c */
+
+/* aoeasync.c */
+void aoeasync_init(struct aoeblkdev *abd);
+void aoeasync_exit(struct aoeblkdev *abd);
+int aoeasync_write(struct aoerequest *work, unsigned int offset,
+		   unsigned int len, u64 lba);
+void aoeasync_wait(struct aoeblkdev *abd, u64 lba, unsigned int nsect);
+int aoeasync_flush(struct aoeblkdev *abd);
+void aoeasync_setmax(struct aoeblkdev *abd, unsigned long bytes);
+/* end aoeasync.c */
+
 /* aoeproc.c */
 int aoeproc_init(void);
 int aoeproc_exit(void);
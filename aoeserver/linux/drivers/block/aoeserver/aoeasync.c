@@ -0,0 +1,233 @@
+/*
+ *  linux/drivers/block/aoeserver/aoeasync.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file handle writes with the async flag set. The
+ * initiator doesnt want to wait for those, so they are acknowledged as
+ * soon as they have been put in the buffer of the device, and written
+ * to the backing device in the background. The buffer holds the request
+ * skbs themselves, nothing is copied, and at most as.max bytes of data.
+ * When it is full async writes are done like any other write.
+ *
+ * Reads and writes of sectors that are still in the buffer wait for them
+ * to be written first, a flush waits for the whole buffer and reports a
+ * failed write from it. The buffer is written out before a device goes
+ * away.
+ *
+ * Everything here runs in process context, from kaoed or from the drain
+ * on aoe_iowq.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+
+#include "aoe.h"
+
+/* A write in the buffer */
+struct aoeasyncw {
+	struct list_head list;
+	struct sk_buff *skb;	/* The request, holding the data */
+	unsigned int offset;	/* Of the data, from skb->data */
+	unsigned int len;
+	u64 lba;
+	ktime_t t_ack;		/* When it was acknowledged */
+};
+
+/* Write out the buffer, oldest first. A write stays in the buffer until
+ * it is on the device, so anything it overlaps keeps waiting for it. */
+static void aoeasync_drain(struct work_struct *work)
+{
+	struct aoeblkdev *abd = container_of(work, struct aoeblkdev, as.work);
+	struct aoeasync *as = &abd->as;
+	struct aoeasyncw *w;
+	ssize_t ret;
+
+	spin_lock(&as->lock);
+
+	while (!list_empty(&as->queue)) {
+		w = list_entry(as->queue.next, struct aoeasyncw, list);
+		spin_unlock(&as->lock);
+
+		ret = bldev_write_wait(abd, w->skb, w->offset, w->len,
+				       w->lba * 512);
+		if (ret != w->len)
+			aoestats_add(abd->stats, AOESTAT_IOERR, 1);
+		aoestats_hist(abd->stats, AOEHIST_DRAIN, w->t_ack, ktime_get());
+
+		spin_lock(&as->lock);
+		if (ret != w->len && as->error == 0)
+			as->error = ret < 0 ? ret : -EIO;
+		list_del(&w->list);
+		as->bytes -= w->len;
+		spin_unlock(&as->lock);
+
+		wake_up(&as->wait);
+		kfree_skb(w->skb);
+		kfree(w);
+
+		spin_lock(&as->lock);
+	}
+
+	as->draining = 0;
+	spin_unlock(&as->lock);
+
+	wake_up(&as->wait);
+}
+
+/* Take a write of len bytes at sector lba, the data is found offset bytes
+ * into the request skb, into the buffer if the initiator set the async
+ * flag and there is room. Returns zero if the write was taken and has
+ * been acknowledged, or -1 if the caller writes the data itself. */
+int aoeasync_write(struct aoerequest *work, unsigned int offset,
+		   unsigned int len, u64 lba)
+{
+	struct aoeblkdev *abd = work->abd;
+	struct aoeasync *as = &abd->as;
+	struct aoeasyncw *w;
+	int drain = 0;
+
+	if (!(work->atarequest->flags & AOE_ATAFLAG_ASYNC) || as->max == 0 ||
+	    len == 0)
+		return (-1);
+
+	w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (w == NULL)
+		return (-1);
+
+	/* Gathered sectors the write overlaps go out before it */
+	aoecache_read(abd, lba, len / 512);
+
+	spin_lock(&as->lock);
+
+	if (as->bytes + len > as->max) {
+		spin_unlock(&as->lock);
+		kfree(w);
+		aoestats_inc(work, AOESTAT_ASYNCFULL);
+		return (-1);
+	}
+
+	/* The request skb is ours until it has been written */
+	w->skb = skb_get(work->skb_req);
+	w->offset = offset;
+	w->len = len;
+	w->lba = lba;
+	w->t_ack = ktime_get();
+
+	list_add_tail(&w->list, &as->queue);
+	as->bytes += len;
+
+	if (!as->draining) {
+		as->draining = 1;
+		drain = 1;
+	}
+
+	spin_unlock(&as->lock);
+
+	if (drain)
+		queue_work(aoe_iowq, &as->work);
+
+	aoestats_inc(work, AOESTAT_ASYNC);
+
+	aoe_trace(aoeserver_io_complete, work->aoereq);
+	aoexmit(work);
+
+	return (0);
+}
+
+/* Check if any of nsect sectors at lba are still in the buffer */
+static int aoeasync_busy(struct aoeasync *as, u64 lba, unsigned int nsect)
+{
+	struct aoeasyncw *w;
+	int busy = 0;
+
+	spin_lock(&as->lock);
+	list_for_each_entry(w, &as->queue, list)
+	    if (lba < w->lba + w->len / 512 && lba + nsect > w->lba) {
+		busy = 1;
+		break;
+	}
+	spin_unlock(&as->lock);
+
+	return (busy);
+}
+
+/* A read or write of nsect sectors at lba is about to be done, wait for
+ * the buffered writes it overlaps to be written */
+void aoeasync_wait(struct aoeblkdev *abd, u64 lba, unsigned int nsect)
+{
+	struct aoeasync *as = &abd->as;
+
+	if (as->bytes == 0)
+		return;
+
+	wait_event(as->wait, !aoeasync_busy(as, lba, nsect));
+}
+
+/* Wait for the buffer to be written, for the flush cache command. Returns
+ * the error of a failed write since the last flush, if any. */
+int aoeasync_flush(struct aoeblkdev *abd)
+{
+	struct aoeasync *as = &abd->as;
+	int ret;
+
+	wait_event(as->wait, list_empty(&as->queue));
+
+	spin_lock(&as->lock);
+	ret = as->error;
+	as->error = 0;
+	spin_unlock(&as->lock);
+
+	return (ret);
+}
+
+/* Set the size of the buffer in bytes, zero ignores the async flag.
+ * Whatever is in the buffer stays there until it has been written. */
+void aoeasync_setmax(struct aoeblkdev *abd, unsigned long bytes)
+{
+	spin_lock(&abd->as.lock);
+	abd->as.max = bytes;
+	spin_unlock(&abd->as.lock);
+}
+
+void aoeasync_init(struct aoeblkdev *abd)
+{
+	struct aoeasync *as = &abd->as;
+
+	spin_lock_init(&as->lock);
+	INIT_LIST_HEAD(&as->queue);
+	as->bytes = 0;
+	as->max = AOE_ASYNC_DEFAULT;
+	as->draining = 0;
+	as->error = 0;
+	INIT_WORK(&as->work, aoeasync_drain);
+	init_waitqueue_head(&as->wait);
+}
+
+/* The device is going away and no requests are left, wait for the buffer
+ * to be written */
+void aoeasync_exit(struct aoeblkdev *abd)
+{
+	struct aoeasync *as = &abd->as;
+
+	wait_event(as->wait, list_empty(&as->queue) && !as->draining);
+	cancel_work_sync(&as->work);
+
+	if (as->error)
+		printk(KERN_ERR "aoeserver: %s: async write failed, %d\n",
+		       abd->name, as->error);
+}
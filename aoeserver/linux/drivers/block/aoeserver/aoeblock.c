@@ -17,7 +17,8 @@
  * The functions in this file takes care of the exported blockdevices, 
  * keeps a track of shared devices, open and close, reading and writing 
  * to block-devices. Most of the function, expect for find_aoedevice, runs
- * in process context and may sleep. 
+ * in process context and may sleep. Lookups from the network path are
+ * lock-free, the device list and hash are protected by rcu. 
  */
 
 #include <linux/kernel.h>
@@ -27,37 +28,64 @@
 #include <linux/skbuff.h>
 #include <linux/hdreg.h>
 #include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/netdevice.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <asm/fcntl.h>
 
 #include "aoe.h"
 
-struct aoeblkdev *abd_head = NULL;
-DEFINE_RWLOCK(abd_lock);
+/* Submit reads and writes to block devices as bios and reply from the
+ * completion, instead of waiting in do_sync_read()/do_sync_write() */
+static int aoe_aio = 1;
+module_param_named(aio, aoe_aio, int, 0644);
+MODULE_PARM_DESC(aio, "Use asynchronous bios for block devices (default 1)");
 
-/* Find the appropriate device in the device list */
+/* Send synchronous reads straight from the page cache */
+static int aoe_zerocopy = 1;
+module_param_named(zerocopy, aoe_zerocopy, int, 0644);
+MODULE_PARM_DESC(zerocopy, "Attach page cache pages to read replies (default 1)");
+
+/* All exported devices. Writers hold abd_mutex, readers walking the
+ * list or the hash from softirq-context only need rcu_read_lock() */
+LIST_HEAD(abd_list);
+DEFINE_MUTEX(abd_mutex);
+
+/* Exported devices hashed on shelf and slot, see find_aoedevice() */
+static struct hlist_head abd_hash[AOE_HASH_SIZE];
+
+static void aoeblock_resizecheck(struct work_struct *unused);
+
+/* Looks for devices that have grown or shrunk under us, runs for as
+ * long as something is exported */
+static DECLARE_DELAYED_WORK(aoeblock_resize_work, aoeblock_resizecheck);
+
+static inline struct hlist_head *abd_hashbucket(int shelf, int slot)
+{
+	return (&abd_hash[aoeproto_hash(shelf, slot)]);
+}
+
+/* Find the appropriate device in the device hash */
 /* This function is called from aoenet.c in soft-irq-context and
- * must therefore never sleep */
+ * must therefore never sleep. The caller must either be inside
+ * rcu_read_lock() or hold abd_mutex. */
 struct aoeblkdev *find_aoedevice(int shelf, int slot, int ifindex)
 {
-	struct aoeblkdev *abd = NULL;
+	struct aoeblkdev *abd;
+	struct hlist_node *node;
 
-	if (abd_head == NULL)
-		return (NULL);
+	hlist_for_each_entry_rcu(abd, node, abd_hashbucket(shelf, slot), hash)
+	    if (abd->shelf == shelf && abd->slot == slot &&
+		(abd->ifindex == ifindex || abd->ifindex == 0
+		 || ifindex == 0))
+		return (abd);
 
-	read_lock(&abd_lock);
-	{
-		if (abd_head == NULL)
-			return (NULL);
-
-		list_for_each_entry(abd, &abd_head->list, list)
-		    if (abd->shelf == shelf && abd->slot == slot &&
-			(abd->ifindex == ifindex || abd->ifindex == 0
-			 || ifindex == 0)) {
-			read_unlock(&abd_lock);
-			return (abd);
-		}
-	}
-	read_unlock(&abd_lock);
 	return (NULL);
 }
 
@@ -66,43 +94,58 @@ int aoeblock_register(char *device, int shelf, int slot, int ifindex)
 {
 	struct aoeblkdev *abd;
 	struct file *fp = NULL;
-	struct inode *inode = NULL;
-	struct address_space *mapping = NULL;
 
 	if (!device)
 		return -1;
 
+	mutex_lock(&abd_mutex);
+
 	/* Make sure nothing else is exported on this shelf,slot,ifindex */
 	if (find_aoedevice(shelf, slot, ifindex) ||
 	    find_aoedevice(shelf, slot, 0)) {
 		printk(KERN_ERR
 		       "WARNING: Selected configuration already in use\n");
-		return (-1);
+		goto out_unlock;
 	}
 
 	fp = filp_open(device, O_RDONLY, 00);
 	if (IS_ERR(fp)) {
 		printk(KERN_ERR
 		       "WARNING: Failed to open device: %s\n", device);
-		return (-1);
+		goto out_unlock;
 	}
 
 	printk("Exporting: %s\n", device);
 
-	abd = kmalloc(sizeof(*abd), GFP_KERNEL);
+	abd = kzalloc(sizeof(*abd), GFP_KERNEL);
 	if (abd == NULL) {
 		printk("kmalloc failed!\n");
 		filp_close(fp, NULL);
-		return (-1);
+		goto out_unlock;
+	}
+
+	abd->stats = aoestats_alloc();
+	if (abd->stats == NULL) {
+		printk("kmalloc failed!\n");
+		kfree(abd);
+		filp_close(fp, NULL);
+		goto out_unlock;
 	}
 
 	/* fillout struct */
 	abd->fp = fp;
 	abd->shelf = shelf;
 	abd->slot = slot;
-	atomic_set(&abd->queuecounter, 0);
+	atomic_set(&abd->queuecounter, 1);	/* See aoewq_exit() */
+	abd->qdepth = AOE_DEFQDEPTH;
+	seqcount_init(&abd->size_seq);
 	abd->size = i_size_read(fp->f_mapping->host) >> 9;
-	abd->acl_lock = RW_LOCK_UNLOCKED;
+
+	/* Block devices can take bios directly, the open file
+	 * holds the reference to the block_device for us */
+	if (S_ISBLK(fp->f_mapping->host->i_mode))
+		abd->bdev = I_BDEV(fp->f_mapping->host);
+	rwlock_init(&abd->acl_lock);
 	abd->acl = NULL;
 
 	strncpy(abd->name, device, 30);
@@ -111,97 +154,117 @@ int aoeblock_register(char *device, int shelf, int slot, int ifindex)
 	 * indicate that we dont care on wich interface the request came in */
 	abd->ifindex = ifindex;
 
-	/* Start the queue */
+	/* Start the queue, the write cache starts out off */
 	aoewq_init(abd);
+	aoecache_init(abd);
+	aoestream_init(abd);
+	aoetag_init(abd);
+	aoeflush_init(abd);
+	aoeasync_init(abd);
 
 	/* Setup initial cfg-data for device */
-	memset(abd->cfg_data, 255, 1024);
-	strncpy(abd->cfg_data, device, 1024);
-	abd->cfg_len = strlen(abd->cfg_data);
+	spin_lock_init(&abd->tmpl_lock);
+	memset(abd->cfg.data, 255, 1024);
+	strncpy(abd->cfg.data, device, 1024);
+	abd->cfg_len = strlen(abd->cfg.data);
 
-	write_lock(&abd_lock);
-	{
-		/* If we havent initialised the list-head before */
-		if (abd_head == NULL) {
-			/* First entry */
-			abd_head = kmalloc(sizeof(*abd_head), GFP_KERNEL);
-			/* Make sure all pointers are null */
-			abd_head->acl = NULL;
-			abd_head->fp = NULL;
-			abd_head->kaoed_wq = NULL;
-
-			/* init the linked list */
-			INIT_LIST_HEAD(&abd_head->list);
-		}
+	/* Prepare the config and identify replies */
+	bldev_buildcfg(abd);
+	bldev_buildid(abd);
 
-		/* Add this new entry */
-		list_add(&(abd->list), &(abd_head->list));
-	}
-	write_unlock(&abd_lock);
+	/* Publish the new entry, aoenet_rcv() may see it from now on */
+	list_add_rcu(&abd->list, &abd_list);
+	hlist_add_head_rcu(&abd->hash, abd_hashbucket(shelf, slot));
+
+	mutex_unlock(&abd_mutex);
+
+	/* Start watching the size of the device, if we werent already */
+	schedule_delayed_work(&aoeblock_resize_work, AOE_RESIZE_INTERVAL);
+
+	/* The device should show up in discovery replies */
+	aoenet_changed();
 
 	/* We are ready to recieve network traffic */
 	aoenet_init();
 
 	return (0);
+
+      out_unlock:
+	mutex_unlock(&abd_mutex);
+	return (-1);
+}
+
+/* Release everything held by a device that has been unlinked from 
+ * abd_list and abd_hash. The caller must have waited for a grace period
+ * so that no softirq can still be queueing work for this device. */
+static void aoeblock_free(struct aoeblkdev *abd)
+{
+	struct list_head *aclpos, *aclq;
+	struct accesslist *acl;
+
+	/* No more work can be added, we can safely 
+	 * flush the queue and kill the worker thread*/
+	aoewq_exit(abd);
+	aoeflush_exit(abd);
+
+	/* Write out what the async buffer and the write cache still hold */
+	aoeasync_exit(abd);
+	aoecache_exit(abd);
+	aoetag_exit(abd);
+
+	if (abd->fp && !IS_ERR(abd->fp))
+		filp_close(abd->fp, NULL);
+
+	/* Free ACL */
+	write_lock_bh(&abd->acl_lock);
+	if (abd->acl != NULL) {
+		list_for_each_safe(aclpos, aclq, &abd->acl->list) {
+			acl = list_entry(aclpos, struct accesslist, list);
+			list_del(aclpos);
+			kfree(acl);
+		}
+		kfree(abd->acl);
+	}
+	write_unlock_bh(&abd->acl_lock);
+
+	aoestats_free(abd->stats);
+	kfree(abd);
+
+	/* Decrement counter for network */
+	aoenet_exit();
 }
 
 /* Remove a device from the device list */
 int aoeblock_unregister(char *device, int shelf, int slot, int ifindex)
 {
 	struct aoeblkdev *abd;
-	struct list_head *pos, *q;
-	struct list_head *aclpos, *aclq;
-	struct accesslist *acl;
 
-	write_lock(&abd_lock);
-	{
-		if (abd_head != NULL)
-			list_for_each_safe(pos, q, &abd_head->list) {
-			abd = list_entry(pos, struct aoeblkdev, list);
-
-			if ((abd->shelf == shelf) &&
-			    (abd->slot == slot) && (abd->ifindex == ifindex)) {
-			        /* We remove it from the list before we 
-				 * stop the workqueue */
-				list_del(pos);
+	mutex_lock(&abd_mutex);
+	list_for_each_entry(abd, &abd_list, list)
+	    if ((abd->shelf == shelf) &&
+		(abd->slot == slot) && (abd->ifindex == ifindex)) {
+		/* We remove it from the list before we 
+		 * stop the workqueue */
+		list_del_rcu(&abd->list);
+		hlist_del_rcu(&abd->hash);
+		mutex_unlock(&abd_mutex);
 
-				/* No more work can be added, we can safely 
-				 * flush the queue and kill the worker thread*/
-				aoewq_exit(abd);
-
-				if (abd->fp && !IS_ERR(abd->fp))
-					filp_close(abd->fp, NULL);
-
-				/* Free ACL */
-				write_lock(&abd->acl_lock);
-				if (abd->acl != NULL) {
-					list_for_each_safe(aclpos, aclq,
-							   &abd->acl->list) {
-						acl =
-						    list_entry(aclpos,
-							       struct
-							       accesslist,
-							       list);
-						list_del(aclpos);
-						kfree(acl);
-					}
-					kfree(abd->acl);
-				}
-				write_unlock(&abd->acl_lock);
-
-				kfree(abd);
-
-				/* Decrement counter for network */
-				aoenet_exit();
-			}
-			}
+		aoenet_changed();
+
+		/* Wait for aoenet_rcv() to let go of it */
+		synchronize_rcu();
+
+		aoeblock_free(abd);
+		return (0);
 	}
-	write_unlock(&abd_lock);
+	mutex_unlock(&abd_mutex);
 
 	return (0);
 }
 
-/* Verify a source address against the access control list */
+/* Verify a source address against the access control list. This is also
+ * called from aoenet_discover() in softirq-context, so writers have to
+ * keep bottom halves disabled. */
 int aoeblock_acl(struct aoeblkdev *abd, unsigned char *h_source)
 {
 	struct accesslist *acl;
@@ -218,6 +281,9 @@ int aoeblock_acl(struct aoeblkdev *abd, unsigned char *h_source)
 	}
 	read_unlock(&abd->acl_lock);
 
+	if (ret != 0)
+		aoestats_add(abd->stats, AOESTAT_ACL, 1);
+
 	return (ret);
 }
 
@@ -227,26 +293,36 @@ int aoeblock_mask(unsigned short shelf,
 {
 	struct aoeblkdev *abd;
 	struct accesslist *acl;
+	int ret = 0;
+
+	/* Keeps the device from being unregistered under us */
+	mutex_lock(&abd_mutex);
 
 	abd = find_aoedevice(shelf, slot, 0);
-	if (abd == NULL)
-		return (-EINVAL);
+	if (abd == NULL) {
+		ret = -EINVAL;
+		goto out;
+	}
 
 	acl = kmalloc(sizeof(*acl), GFP_KERNEL);
-	if (acl == NULL)
-		return (-ENOMEM);
+	if (acl == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	/* Add requested address to acl */
 	memcpy(acl->h_source, h_source, ETH_ALEN);
 
-	write_lock(&abd->acl_lock);
+	write_lock_bh(&abd->acl_lock);
 	{
 		/* If we havent initialised the list-head before */
 		if (abd->acl == NULL) {
-			abd->acl = kmalloc(sizeof(*abd->acl), GFP_KERNEL);
+			abd->acl = kmalloc(sizeof(*abd->acl), GFP_ATOMIC);
 			if (abd->acl == NULL) {
-				write_unlock(&abd->acl_lock);
-				return (-ENOMEM);
+				write_unlock_bh(&abd->acl_lock);
+				kfree(acl);
+				ret = -ENOMEM;
+				goto out;
 			}
 			INIT_LIST_HEAD(&abd->acl->list);
 		}
@@ -255,9 +331,11 @@ int aoeblock_mask(unsigned short shelf,
 		list_add(&(acl->list), &(abd->acl->list));
 	}
 
-	write_unlock(&abd->acl_lock);
+	write_unlock_bh(&abd->acl_lock);
 
-	return (0);
+      out:
+	mutex_unlock(&abd_mutex);
+	return (ret);
 }
 
 /* Remove an entry from the access list for the specified device */
@@ -268,11 +346,15 @@ int aoeblock_rmmask(unsigned short shelf,
 	struct accesslist *acl;
 	struct list_head *pos, *q;
 
+	mutex_lock(&abd_mutex);
+
 	abd = find_aoedevice(shelf, slot, 0);
-	if (abd == NULL)
+	if (abd == NULL) {
+		mutex_unlock(&abd_mutex);
 		return (-EINVAL);
+	}
 
-	write_lock(&abd->acl_lock);
+	write_lock_bh(&abd->acl_lock);
 	if (abd->acl != NULL) {
 		list_for_each_safe(pos, q, &abd->acl->list) {
 			acl = list_entry(pos, struct accesslist, list);
@@ -292,114 +374,958 @@ int aoeblock_rmmask(unsigned short shelf,
 			abd->acl = NULL;
 		}
 	}
-	write_unlock(&abd->acl_lock);
+	write_unlock_bh(&abd->acl_lock);
+
+	mutex_unlock(&abd_mutex);
+
+	return (0);
+}
+
+/* Change the number of requests we are willing to queue for a device,
+ * this is also the buffer count we advertise in config replies */
+int aoeblock_setqdepth(unsigned short shelf, unsigned short slot, int qdepth)
+{
+	struct aoeblkdev *abd;
+
+	if (qdepth < 1 || qdepth > AOE_MAXQDEPTH)
+		return (-EINVAL);
+
+	mutex_lock(&abd_mutex);
+
+	abd = find_aoedevice(shelf, slot, 0);
+	if (abd == NULL) {
+		mutex_unlock(&abd_mutex);
+		return (-EINVAL);
+	}
+
+	/* Grow the request pool before we let more requests in, and
+	 * shrink it after we have lowered the limit */
+	if (qdepth > abd->qdepth && aoewq_resize(abd, qdepth) != 0) {
+		mutex_unlock(&abd_mutex);
+		return (-ENOMEM);
+	}
+
+	abd->qdepth = qdepth;
+
+	spin_lock_bh(&abd->tmpl_lock);
+	bldev_buildcfg(abd);
+	spin_unlock_bh(&abd->tmpl_lock);
+
+	aoenet_changed();
+
+	if (aoewq_resize(abd, qdepth) != 0)
+		printk(KERN_ERR "aoeblock_setqdepth(): Failed to resize pool\n");
+
+	mutex_unlock(&abd_mutex);
+
+	return (0);
+}
+
+/* Find the numa node closest to a device, that is the node of the 
+ * backing block device, or the node of the network interface the device
+ * is exported on. Returns -1 if we cant tell. */
+static int aoeblock_node(struct aoeblkdev *abd)
+{
+	struct net_device *dev;
+	int node = -1;
+
+	if (abd->bdev && bdev_get_queue(abd->bdev))
+		node = bdev_get_queue(abd->bdev)->node;
+
+	if (node < 0 && abd->ifindex > 0 &&
+	    (dev = dev_get_by_index(&init_net, abd->ifindex))) {
+		if (dev->dev.parent)
+			node = dev_to_node(dev->dev.parent);
+		dev_put(dev);
+	}
+
+	return (node);
+}
+
+/* Restrict the cpus requests for a device are handled on. cpus is either
+ * a cpu list such as "0-3,8", "local" for the cpus on the numa node of 
+ * the device or "rx" to handle requests on the cpu that recieved them */
+int aoeblock_setcpus(unsigned short shelf, unsigned short slot, char *cpus)
+{
+	struct aoeblkdev *abd;
+	cpumask_t mask;
+	int node;
+	int ret = 0;
+
+	mutex_lock(&abd_mutex);
+
+	abd = find_aoedevice(shelf, slot, 0);
+	if (abd == NULL) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (strcmp(cpus, "rx") == 0) {
+		cpus_clear(abd->cpus);
+		goto out;
+	}
+
+	if (strcmp(cpus, "local") == 0) {
+		if ((node = aoeblock_node(abd)) < 0) {
+			ret = -EINVAL;
+			goto out;
+		}
+		mask = node_to_cpumask(node);
+	} else if (cpulist_parse(cpus, mask) != 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* There are only kaoed threads on the cpus that were online */
+	cpus_and(mask, mask, cpu_online_map);
+	if (cpus_empty(mask)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	abd->cpus = mask;
+
+      out:
+	mutex_unlock(&abd_mutex);
+	return (ret);
+}
+
+/* Set the mode of the write cache of a device, "off", "through" or
+ * "back". The identify data tells initiators if they need to flush. */
+int aoeblock_setwcache(unsigned short shelf, unsigned short slot, char *mode)
+{
+	struct aoeblkdev *abd;
+	int wc, ret;
+
+	if (strcmp(mode, "off") == 0)
+		wc = AOE_WC_OFF;
+	else if (strcmp(mode, "through") == 0)
+		wc = AOE_WC_THROUGH;
+	else if (strcmp(mode, "back") == 0)
+		wc = AOE_WC_BACK;
+	else
+		return (-EINVAL);
+
+	mutex_lock(&abd_mutex);
+
+	abd = find_aoedevice(shelf, slot, 0);
+	if (abd == NULL) {
+		mutex_unlock(&abd_mutex);
+		return (-EINVAL);
+	}
+
+	ret = aoecache_setmode(abd, wc);
+	if (ret == 0) {
+		spin_lock_bh(&abd->tmpl_lock);
+		bldev_buildid(abd);
+		spin_unlock_bh(&abd->tmpl_lock);
+	}
+
+	mutex_unlock(&abd_mutex);
+
+	return (ret);
+}
+
+/* Set the read-ahead window for sequential streams of a device, in
+ * kilobytes. Zero turns read-ahead off. */
+int aoeblock_setreadahead(unsigned short shelf, unsigned short slot,
+			  unsigned long kb)
+{
+	struct aoeblkdev *abd;
+
+	if (kb > AOE_RA_MAX / 1024)
+		return (-EINVAL);
+
+	mutex_lock(&abd_mutex);
+
+	abd = find_aoedevice(shelf, slot, 0);
+	if (abd == NULL) {
+		mutex_unlock(&abd_mutex);
+		return (-EINVAL);
+	}
+
+	aoestream_setra(abd, kb * 1024 / PAGE_CACHE_SIZE);
+
+	mutex_unlock(&abd_mutex);
 
 	return (0);
 }
 
+/* Turn direct mode of a device "on" or "off". In direct mode reads and
+ * writes of block devices are submitted as bios, whatever the aio
+ * parameter says, and anything that has to go through the page cache
+ * is dropped from it right after. Whatever the page cache holds of the
+ * device when the mode changes is written out and dropped, so the two
+ * paths dont see stale data. Requests in flight while the mode changes
+ * may still leave pages behind. */
+int aoeblock_setdirect(unsigned short shelf, unsigned short slot, char *mode)
+{
+	struct aoeblkdev *abd;
+	struct address_space *mapping;
+	int direct, ret;
+
+	if (strcmp(mode, "on") == 0)
+		direct = 1;
+	else if (strcmp(mode, "off") == 0)
+		direct = 0;
+	else
+		return (-EINVAL);
+
+	mutex_lock(&abd_mutex);
+
+	abd = find_aoedevice(shelf, slot, 0);
+	if (abd == NULL) {
+		mutex_unlock(&abd_mutex);
+		return (-EINVAL);
+	}
+
+	abd->direct = direct;
+
+	mapping = abd->fp->f_mapping;
+	ret = filemap_write_and_wait(mapping);
+	invalidate_mapping_pages(mapping, 0, ~0UL);
+
+	mutex_unlock(&abd_mutex);
+
+	return (ret);
+}
+
+/* Set how long a flush of a device waits for more flushes to join it,
+ * in microseconds */
+int aoeblock_setflushwindow(unsigned short shelf, unsigned short slot,
+			    unsigned int usecs)
+{
+	struct aoeblkdev *abd;
+
+	if (usecs > AOE_FLUSH_MAXWINDOW)
+		return (-EINVAL);
+
+	mutex_lock(&abd_mutex);
+
+	abd = find_aoedevice(shelf, slot, 0);
+	if (abd == NULL) {
+		mutex_unlock(&abd_mutex);
+		return (-EINVAL);
+	}
+
+	abd->fl.window = usecs;
+
+	mutex_unlock(&abd_mutex);
+
+	return (0);
+}
+
+/* Set the size of the buffer for async writes of a device, in kilobytes.
+ * Zero makes async writes wait for the disk like any other. */
+int aoeblock_setasync(unsigned short shelf, unsigned short slot,
+		      unsigned long kb)
+{
+	struct aoeblkdev *abd;
+
+	if (kb > AOE_ASYNC_MAX / 1024)
+		return (-EINVAL);
+
+	mutex_lock(&abd_mutex);
+
+	abd = find_aoedevice(shelf, slot, 0);
+	if (abd == NULL) {
+		mutex_unlock(&abd_mutex);
+		return (-EINVAL);
+	}
+
+	aoeasync_setmax(abd, kb * 1024);
+
+	mutex_unlock(&abd_mutex);
+
+	return (0);
+}
+
+/* The size of a device in sectors, safe to call from any context */
+u64 aoeblock_size(struct aoeblkdev *abd)
+{
+	unsigned int seq;
+	u64 size;
+
+	do {
+		seq = read_seqcount_begin(&abd->size_seq);
+		size = abd->size;
+	} while (read_seqcount_retry(&abd->size_seq, seq));
+
+	return (size);
+}
+
+/* Pick up a new size of the backing device, like when an lvm volume has
+ * been extended. Requests in flight are not affected, the new size is
+ * used for requests checked after this. Called with abd_mutex held. */
+static void aoeblock_revalidate(struct aoeblkdev *abd)
+{
+	u64 size = i_size_read(abd->fp->f_mapping->host) >> 9;
+
+	if (size == abd->size)
+		return;
+
+	printk(KERN_INFO "aoeserver: %s changed size from %llu to %llu sectors\n",
+	       abd->name, (unsigned long long)abd->size,
+	       (unsigned long long)size);
+
+	spin_lock_bh(&abd->tmpl_lock);
+	write_seqcount_begin(&abd->size_seq);
+	abd->size = size;
+	write_seqcount_end(&abd->size_seq);
+	bldev_buildid(abd);
+	spin_unlock_bh(&abd->tmpl_lock);
+}
+
+/* Check the size of all exported devices, and come back later if there
+ * still is anything exported */
+static void aoeblock_resizecheck(struct work_struct *unused)
+{
+	struct aoeblkdev *abd;
+	int more;
+
+	mutex_lock(&abd_mutex);
+	list_for_each_entry(abd, &abd_list, list)
+	    aoeblock_revalidate(abd);
+	more = !list_empty(&abd_list);
+	mutex_unlock(&abd_mutex);
+
+	if (more)
+		schedule_delayed_work(&aoeblock_resize_work,
+				      AOE_RESIZE_INTERVAL);
+}
+
 /* The aoe target server is shuting down, we need to shutdown all devices,
  * kill off the worker threads and remove the devices from the device list */
 void aoeblock_exit(void)
 {
-	struct aoeblkdev *abd;
-	struct accesslist *acl;
-	struct list_head *pos, *q;
-	struct list_head *aclpos, *aclq;
+	struct aoeblkdev *abd, *n;
+	LIST_HEAD(dead);
+
+	mutex_lock(&abd_mutex);
+	list_for_each_entry_safe(abd, n, &abd_list, list) {
+		/* Remove from list */
+		list_del_rcu(&abd->list);
+		hlist_del_rcu(&abd->hash);
+		list_add(&abd->list, &dead);
+	}
+	mutex_unlock(&abd_mutex);
 
-	write_lock(&abd_lock);
-	{
-		if (abd_head != NULL)
-			list_for_each_safe(pos, q, &abd_head->list) {
-			abd = list_entry(pos, struct aoeblkdev, list);
-
-			/* Remove from list */
-			list_del(pos);
-
-			/* Flush and kill thread */
-			aoewq_exit(abd);
-
-			/* Decrement network active counter */
-			aoenet_exit();
-
-			/* Close file descriptor */
-			if (abd->fp && !IS_ERR(abd->fp))
-				filp_close(abd->fp, NULL);
-
-			/* Remove ACL */
-			write_lock(&abd->acl_lock);
-			if (abd->acl != NULL) {
-				list_for_each_safe(aclpos, aclq,
-						   &abd->acl->list) {
-					acl =
-					    list_entry(aclpos,
-						      struct accesslist, list);
-					list_del(aclpos);
-					kfree(acl);
-				}
-				kfree(abd->acl);
-			}
-			write_unlock(&abd->acl_lock);
+	/* The list is empty, so the size check wont reschedule itself */
+	cancel_delayed_work_sync(&aoeblock_resize_work);
 
-			/* Free the last traces of our block device */
-			kfree(abd);
-			}
+	/* One grace period covers all of them */
+	synchronize_rcu();
+
+	list_for_each_entry_safe(abd, n, &dead, list) {
+		list_del(&abd->list);
+		aoeblock_free(abd);
+	}
+}
+
+/* Set the ata status of the reply from the outcome of a transfer and
+ * count the errors. ret is the number of bytes transfered or a negative
+ * error, len the number of bytes we asked for. Anything but a read, a
+ * flush for instance, fails like a write. */
+void bldev_status(struct aoerequest *work, ssize_t ret, unsigned int len)
+{
+	int write = (aoeproto_rw(work->atarequest) != AOEPROTO_READ);
+
+	switch (aoeproto_status(work->atareply, write, ret, len)) {
+	case 1:
+		aoestats_inc(work, AOESTAT_SHORT);
+		/* Fall through */
+	case -1:
+		aoestats_inc(work, AOESTAT_IOERR);
+		break;
+	}
+}
+
+/* Runs in kaoed once a bio has completed, sends the reply */
+static void bldev_complete(struct aoerequest *work)
+{
+	/* A bio either completes in full or fails */
+	if (work->error)
+		bldev_status(work, work->error, 0);
+	else if (aoeproto_fua(work->atarequest)) {
+		/* The data is in the cache of the disk */
+		aoeflush_request(work);
+		return;
+	}
+
+	aoe_trace(aoeserver_io_complete, work->aoereq);
+	aoexmit(work);
+}
+
+/* Bio completion, this is called in interrupt context so the reply is
+ * handed back to the kaoed thread that submitted the bio */
+static void bldev_endio(struct bio *bio, int error)
+{
+	struct aoerequest *work = bio->bi_private;
+
+	if (error || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		work->error = error ? error : -EIO;
+
+	bio_put(bio);
+
+	aoewq_queue(work, bldev_complete);
+}
+
+/* Add one segment to a bio, the segment has to satisfy the dma 
+ * alignment of the queue since the bio goes straight to the driver */
+static int bldev_bio_add(struct bio *bio, unsigned int align,
+			 struct page *page, unsigned int off, unsigned int len)
+{
+	if ((off | len) & align)
+		return (-1);
+
+	if (bio_add_page(bio, page, len, off) != len)
+		return (-1);
+
+	return (0);
+}
+
+/* Add len bytes of skb data, starting offset bytes into skb->data, to a
+ * bio. The data may be in the linear part, in the page fragments or 
+ * spread over both. */
+static int bldev_bio_skb(struct bio *bio, unsigned int align,
+			 struct sk_buff *skb, unsigned int offset,
+			 unsigned int len)
+{
+	unsigned char *buff;
+	skb_frag_t *frag;
+	unsigned int off, n;
+	int i;
+
+	/* The linear part is kmalloc:ed and may cross page boundaries */
+	while (len > 0 && offset < skb_headlen(skb)) {
+		buff = skb->data + offset;
+		off = offset_in_page(buff);
+		n = min_t(unsigned int, len, PAGE_SIZE - off);
+		n = min_t(unsigned int, n, skb_headlen(skb) - offset);
+
+		if (bldev_bio_add(bio, align, virt_to_page(buff), off, n))
+			return (-1);
+
+		offset += n;
+		len -= n;
+	}
+
+	offset -= min_t(unsigned int, offset, skb_headlen(skb));
+
+	for (i = 0; len > 0 && i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		if (offset >= frag->size) {
+			offset -= frag->size;
+			continue;
+		}
+
+		n = min_t(unsigned int, len, frag->size - offset);
+		if (bldev_bio_add(bio, align, frag->page,
+				  frag->page_offset + offset, n))
+			return (-1);
+
+		offset = 0;
+		len -= n;
+	}
+
+	return (len ? -1 : 0);
+}
+
+/* Check if the requests of a device are submitted to it as bios. The
+ * ones that cant be fall back to the page cache, which then has to be
+ * kept coherent with what the bios do, see bldev_dropbehind(). */
+static inline int bldev_biodev(struct aoeblkdev *abd)
+{
+	return ((aoe_aio || abd->direct) && abd->bdev);
+}
+
+/* Check if a request is going to be submitted as a bio, rather than 
+ * go through the page cache */
+static inline int bldev_aio(struct aoerequest *work)
+{
+	return (bldev_biodev(work->abd) && !work->zerocopy);
+}
+
+/* Plug the queue of a device for the bios of a kaoed pass. Only queues
+ * with an elevator are plugged by hand, stacked devices like md plug
+ * the queues below them themselves. */
+static void bldev_plug(struct aoeblkdev *abd)
+{
+	struct request_queue *q = bdev_get_queue(abd->bdev);
+
+	if (q == NULL || q->request_fn == NULL)
+		return;
+
+	spin_lock_irq(q->queue_lock);
+	blk_plug_device(q);
+	spin_unlock_irq(q->queue_lock);
+}
+
+/* Let a device start on the bios submitted to it */
+void bldev_unplug(struct aoeblkdev *abd)
+{
+	struct request_queue *q = bdev_get_queue(abd->bdev);
+
+	if (q == NULL)
+		return;
+
+	blk_unplug(q);
+	aoestats_add(abd->stats, AOESTAT_UNPLUG, 1);
+}
+
+/* The most pages a bio built on top of skb data can need */
+static inline int bldev_skb_pages(struct sk_buff *skb)
+{
+	int nr_pages = ((skb_headlen(skb) + PAGE_SIZE - 1) >> PAGE_SHIFT) +
+	    1 + skb_shinfo(skb)->nr_frags;
+
+	return (min_t(int, nr_pages, BIO_MAX_PAGES));
+}
+
+/* Build a bio straight on top of the skb data and submit it. Returns
+ * zero if the bio was submitted, the reply is then sent from
+ * bldev_complete(). Otherwise the caller falls back to synchronous io. */
+static int bldev_submit(struct aoerequest *work, int rw, struct sk_buff *skb,
+			unsigned int offset, unsigned int len, loff_t ppos)
+{
+	struct aoeblkdev *abd = work->abd;
+	struct bio *bio;
+	int plug;
+
+	if (!bldev_aio(work))
+		return (-1);
+
+	/* The bio has to cover whole logical blocks of the device, with
+	 * 4k sectors a request of a few 512 byte sectors may not */
+	if ((ppos | len) & (bdev_hardsect_size(abd->bdev) - 1)) {
+		if (abd->direct)
+			aoestats_inc(work, AOESTAT_UNALIGNED);
+		return (-1);
+	}
+
+	bio = bio_alloc(GFP_NOIO, bldev_skb_pages(skb));
+	if (bio == NULL)
+		return (-1);
+
+	bio->bi_sector = ppos >> 9;
+	bio->bi_bdev = abd->bdev;
+	bio->bi_end_io = bldev_endio;
+	bio->bi_private = work;
+
+	if (bldev_bio_skb(bio, queue_dma_alignment(bdev_get_queue(abd->bdev)),
+			  skb, offset, len) != 0) {
+		bio_put(bio);
+		if (abd->direct)
+			aoestats_inc(work, AOESTAT_UNALIGNED);
+		return (-1);
+	}
+
+	work->error = 0;
+
+	/* Bios of the same pass are merged while the queue is plugged */
+	plug = aoewq_plug(abd);
+	if (plug > 0)
+		bldev_plug(abd);
+
+	aoestats_inc(work, AOESTAT_BIO);
+	submit_bio(rw, bio);
+
+	if (plug < 0)
+		bldev_unplug(abd);
+
+	return (0);
+}
+
+/* A bio submitted by bldev_bio_wait() */
+struct bldev_wait {
+	struct completion done;
+	int error;
+};
+
+static void bldev_endio_wait(struct bio *bio, int error)
+{
+	struct bldev_wait *w = bio->bi_private;
+
+	if (error || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		w->error = error ? error : -EIO;
+
+	bio_put(bio);
+
+	complete(&w->done);
+}
+
+/* Submit a bio and wait for it, for the writes that are done outside of
+ * a request. The bio is sync, so the queue is unplugged right away.
+ * Returns zero or the error. */
+static int bldev_bio_wait(struct bio *bio, int rw)
+{
+	struct bldev_wait w;
+
+	init_completion(&w.done);
+	w.error = 0;
+
+	bio->bi_end_io = bldev_endio_wait;
+	bio->bi_private = &w;
+
+	submit_bio(rw | (1 << BIO_RW_SYNC), bio);
+	wait_for_completion(&w.done);
+
+	return (w.error);
+}
+
+/* Write len bytes of a vmalloc:ed buffer at ppos, for the write cache.
+ * Like the requests of the device the buffer goes to it as bios, so the
+ * extent doesnt linger dirty in the page cache. Returns the number of
+ * bytes written or a negative error. */
+ssize_t bldev_write_buf(struct aoeblkdev *abd, char *buf, unsigned int len,
+			loff_t ppos)
+{
+	struct bio *bio;
+	unsigned int done = 0, n;
+	loff_t start = ppos;
+	ssize_t ret;
+	int err;
+
+	if (!bldev_biodev(abd) ||
+	    ((ppos | len) & (bdev_hardsect_size(abd->bdev) - 1)))
+		goto fallback;
+
+	while (done < len) {
+		n = (len - done + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		bio = bio_alloc(GFP_NOIO, min_t(int, n, BIO_MAX_PAGES));
+		if (bio == NULL)
+			return (done ? done : -ENOMEM);
+
+		bio->bi_sector = (ppos + done) >> 9;
+		bio->bi_bdev = abd->bdev;
+
+		/* The buffer is page aligned, add pages until the bio is
+		 * full */
+		while (done < len) {
+			n = min_t(unsigned int, len - done, PAGE_SIZE);
+			if (bio_add_page(bio, vmalloc_to_page(buf + done), n,
+					 0) != n)
+				break;
+			done += n;
+		}
+
+		if (bio->bi_size == 0) {
+			bio_put(bio);
+			return (-EIO);
+		}
+
+		err = bldev_bio_wait(bio, WRITE);
+		if (err)
+			return (err);
+	}
+
+	return (len);
+
+      fallback:
+	ret = do_sync_write(abd->fp, buf, len, &ppos);
+	if (ret == len) {
+		err = bldev_dropbehind(abd, start, len, 1);
+		if (err)
+			ret = err;
+	}
+
+	return (ret);
+}
+
+/* Write len bytes of skb data, starting offset bytes into skb->data,
+ * through the file. Data in page fragments is written directly from the
+ * fragments, so the request never has to be linearized. */
+static ssize_t bldev_write_skb(struct file *fp, struct sk_buff *skb,
+			       unsigned int offset, unsigned int len,
+			       loff_t *ppos)
+{
+	skb_frag_t *frag;
+	unsigned int n;
+	ssize_t ret, done = 0;
+	char *vaddr;
+	int i;
+
+	if (len > 0 && offset < skb_headlen(skb)) {
+		n = min_t(unsigned int, len, skb_headlen(skb) - offset);
+		ret = do_sync_write(fp, skb->data + offset, n, ppos);
+		if (ret != n)
+			return (ret < 0 ? ret : done + ret);
+		done += n;
+		len -= n;
+	}
+
+	offset -= min_t(unsigned int, offset, skb_headlen(skb));
+
+	for (i = 0; len > 0 && i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		if (offset >= frag->size) {
+			offset -= frag->size;
+			continue;
+		}
+
+		n = min_t(unsigned int, len, frag->size - offset);
+
+		vaddr = kmap(frag->page);
+		ret = do_sync_write(fp, vaddr + frag->page_offset + offset,
+				    n, ppos);
+		kunmap(frag->page);
+
+		if (ret != n)
+			return (ret < 0 ? ret : done + ret);
+
+		offset = 0;
+		done += n;
+		len -= n;
+	}
+
+	return (done);
+}
+
+/* Write len bytes of skb data at ppos through the file, and drop them
+ * from the page cache again in direct mode. Returns the number of bytes
+ * written or a negative error. */
+static ssize_t bldev_write(struct aoeblkdev *abd, struct sk_buff *skb,
+			   unsigned int offset, unsigned int len, loff_t ppos)
+{
+	loff_t start = ppos;
+	ssize_t ret;
+	int err;
+
+	ret = bldev_write_skb(abd->fp, skb, offset, len, &ppos);
+	if (ret == len) {
+		err = bldev_dropbehind(abd, start, len, 1);
+		if (err)
+			ret = err;
+	}
+
+	return (ret);
+}
+
+/* Write len bytes of skb data at ppos and wait for it, for the async
+ * buffer. Like the requests of the device the data goes to it as a bio
+ * when it can, and through the file otherwise. Returns the number of
+ * bytes written or a negative error. */
+ssize_t bldev_write_wait(struct aoeblkdev *abd, struct sk_buff *skb,
+			 unsigned int offset, unsigned int len, loff_t ppos)
+{
+	struct bio *bio;
+	int err;
+
+	if (!bldev_biodev(abd) ||
+	    ((ppos | len) & (bdev_hardsect_size(abd->bdev) - 1)))
+		return (bldev_write(abd, skb, offset, len, ppos));
+
+	bio = bio_alloc(GFP_NOIO, bldev_skb_pages(skb));
+	if (bio == NULL)
+		return (bldev_write(abd, skb, offset, len, ppos));
+
+	bio->bi_sector = ppos >> 9;
+	bio->bi_bdev = abd->bdev;
+
+	if (bldev_bio_skb(bio, queue_dma_alignment(bdev_get_queue(abd->bdev)),
+			  skb, offset, len) != 0) {
+		bio_put(bio);
+		return (bldev_write(abd, skb, offset, len, ppos));
 	}
-	write_unlock(&abd_lock);
 
-	kfree(abd_head);
+	err = bldev_bio_wait(bio, WRITE);
+
+	return (err ? err : len);
+}
+
+/* Decide if a read is going to be answered with page cache pages rather
+ * than with data in the reply skb. That is the case whenever the read
+ * wont be submitted as a bio and the interface can do scatter/gather. 
+ * create_skb() calls this before the reply is allocated. */
+int bldev_zerocopy(struct aoerequest *work)
+{
+	return (aoe_zerocopy && !work->abd->direct &&
+		!(aoe_aio && work->abd->bdev) &&
+		(work->ifp->features & NETIF_F_SG));
+}
+
+/* A transfer of len bytes at ppos has gone through the page cache of a
+ * device in direct mode, drop the pages again. Written pages are written
+ * out first, so the write is on the device when we reply. The same is
+ * done for a device whose other requests are bios: a page left in the
+ * cache would be read back after a bio has overwritten the sectors, and
+ * a dirty one written back over them. Every page the
+ * transfer touched is dropped, partial ones included, random reads of a
+ * sector or two would otherwise stay cached for good. Returns zero or
+ * the error of the write-out. */
+int bldev_dropbehind(struct aoeblkdev *abd, loff_t ppos, unsigned int len,
+		     int write)
+{
+	struct address_space *mapping = abd->fp->f_mapping;
+	int ret = 0;
+
+	if (!bldev_biodev(abd) && !abd->direct)
+		return (0);
+
+	if (len == 0)
+		return (0);
+
+	if (write)
+		ret = do_sync_mapping_range(mapping, ppos, ppos + len - 1,
+					    SYNC_FILE_RANGE_WAIT_BEFORE |
+					    SYNC_FILE_RANGE_WRITE |
+					    SYNC_FILE_RANGE_WAIT_AFTER);
+
+	invalidate_mapping_pages(mapping, ppos >> PAGE_CACHE_SHIFT,
+				 (ppos + len - 1) >> PAGE_CACHE_SHIFT);
+
+	return (ret);
+}
+
+/* Attach the page cache pages holding len bytes at ppos to the reply.
+ * The pages are read in if needed, the references we get from 
+ * read_mapping_page() are dropped when the driver frees the skb. */
+static int bldev_readpages(struct aoerequest *work, loff_t ppos,
+			   unsigned int len)
+{
+	struct address_space *mapping = work->abd->fp->f_mapping;
+	struct sk_buff *skb = work->skb_rep;
+	struct page *page;
+	unsigned int off, n;
+	int i;
+
+	for (i = 0; len > 0; i++) {
+		if (i >= MAX_SKB_FRAGS)
+			goto fail;
+
+		page = read_mapping_page(mapping, ppos >> PAGE_CACHE_SHIFT,
+					 work->abd->fp);
+		if (IS_ERR(page))
+			goto fail;
+
+		off = ppos & ~PAGE_CACHE_MASK;
+		n = min_t(unsigned int, len, PAGE_CACHE_SIZE - off);
+
+		skb_fill_page_desc(skb, i, page, off, n);
+		skb->len += n;
+		skb->data_len += n;
+		skb->truesize += n;
+
+		ppos += n;
+		len -= n;
+	}
+
+	return (0);
+
+      fail:
+	/* Drop whatever we managed to attach */
+	while (--i >= 0)
+		put_page(skb_shinfo(skb)->frags[i].page);
+	skb_shinfo(skb)->nr_frags = 0;
+	skb->len -= skb->data_len;
+	skb->data_len = 0;
+
+	return (-EIO);
 }
 
 /* this function moves data to or from disk, it is called in the process
  * context of kaoed and can sleep in order to wait for disk-io */
 int bldev_transfer(struct aoerequest *work)
 {
-	loff_t ppos = 0;
-	int i;
-	unsigned char *p;
+	loff_t ppos, start;
+	unsigned int len = work->atarequest->nsect * 512;
+	ssize_t ret;
 	char *buff;
 
-	/* Make space for our ata-header */
-	skb_put(work->skb_rep, sizeof(struct aoe_atahdr));
+	/* The ata-header was added to the reply by handleata(), which also
+	 * made sure the request is within the device */
 
 	/* Convert LBA-address */
-	{
-		p = work->atarequest->lba;
-
-		for (i = 0; i < 6; i++)
-			ppos |= (long long)(*p++) << i * 8;
-
-		if ((work->atarequest->flags & AOE_ATAFLAG_LBA48) == 1)
-			ppos = ppos & 0x0000ffffffffffffLL;	// full 48
-		else
-			ppos = ppos & 0x0fffffff;
-	}
+	ppos = aoeproto_lba(work->atarequest);
 
 	/* Convert to byte offset */
 	ppos *= 512;
+	start = ppos;
+
+	work->t_io = ktime_get();
+	aoe_trace(aoeserver_io_submit, work->aoereq);
+
+	/* Async writes of these sectors that have been acknowledged go
+	 * first */
+	aoeasync_wait(work->abd, ppos >> 9, work->atarequest->nsect);
 
 	switch (work->atarequest->cmdstat) {
 	case WIN_READ:
 	case WIN_READ_EXT:
 
+		/* The write cache may hold newer data */
+		aoecache_read(work->abd, ppos >> 9, work->atarequest->nsect);
+
+		/* Reads through the page cache are read ahead per stream,
+		 * unless the device is to be kept out of it */
+		if (!bldev_aio(work) && !work->abd->direct)
+			aoestream_read(work, ppos, len);
+
+		if (work->zerocopy) {
+			bldev_status(work, bldev_readpages(work, ppos, len), 0);
+			break;
+		}
+
 		/* Make space for data in reply packet */
-		skb_put(work->skb_rep, (work->atarequest->nsect * 512));
+		skb_put(work->skb_rep, len);
 
 		/* reply skb */
 		buff = (char *)work->atareply + sizeof(struct aoe_atahdr);
 
-		do_sync_read(work->abd->fp, buff,
-				  (work->atarequest->nsect * 512), &ppos);
+		if (bldev_submit(work, READ, work->skb_rep,
+				 buff - (char *)work->skb_rep->data,
+				 len, ppos) == 0)
+			return (0);
+
+		/* Pages an earlier fallback couldnt drop may be older than
+		 * the bios written since */
+		bldev_dropbehind(work->abd, start, len, 0);
+
+		ret = do_sync_read(work->abd->fp, buff, len, &ppos);
+		bldev_dropbehind(work->abd, start, len, 0);
+		bldev_status(work, ret, len);
 
 		break;
 
 	case WIN_WRITE:
 	case WIN_WRITE_EXT:
+	case AOE_ATA_WRITE_FUA_EXT:
+	case AOE_ATA_WRITE_MULTI_FUA_EXT:
 
-		/* request skb */
+		/* request skb, only the headers are in the linear part */
 		buff = (char *)work->atarequest + sizeof(struct aoe_atahdr);
 
-		do_sync_write(work->abd->fp, buff,
-				   (work->atarequest->nsect * 512), &ppos);
+		/* Gathered by the write cache, which sends the reply. A fua
+		 * write goes around it, after the gathered sectors it
+		 * overlaps have been written. */
+		if (aoeproto_fua(work->atarequest))
+			aoecache_read(work->abd, ppos >> 9,
+				      work->atarequest->nsect);
+		else if (aoecache_write(work,
+					buff - (char *)work->skb_req->data,
+					len, ppos >> 9) == 0)
+			return (0);
+
+		/* Async writes are acknowledged once they are buffered */
+		if (!aoeproto_fua(work->atarequest) &&
+		    aoeasync_write(work, buff - (char *)work->skb_req->data,
+				   len, ppos >> 9) == 0)
+			return (0);
+
+		if (bldev_submit(work, WRITE, work->skb_req,
+				 buff - (char *)work->skb_req->data,
+				 len, ppos) == 0)
+			return (0);
+
+		ret = bldev_write(work->abd, work->skb_req,
+				  buff - (char *)work->skb_req->data, len, ppos);
+		bldev_status(work, ret, len);
+
+		/* The reply to a fua write waits for a flush */
+		if (ret == len && aoeproto_fua(work->atarequest)) {
+			aoeflush_request(work);
+			return (0);
+		}
 
 		break;
 
@@ -417,17 +1343,84 @@ int bldev_transfer(struct aoerequest *work)
 
 	}
 
+	aoe_trace(aoeserver_io_complete, work->aoereq);
+
 	/* Send packet */
 	aoexmit(work);
 
 	return (0);
 }
 
+/* Make everything written to a device so far stable. The async writes,
+ * the write cache and the dirty pages are written out, and then the
+ * cache of the disk is flushed, that is where the bios went. Returns
+ * zero or the first error. */
+int bldev_sync(struct aoeblkdev *abd)
+{
+	struct file *fp = abd->fp;
+	struct address_space *mapping = fp->f_mapping;
+	int ret, err;
+
+	ret = aoeasync_flush(abd);
+
+	err = aoecache_flush(abd);
+	if (ret == 0)
+		ret = err;
+
+	err = filemap_write_and_wait(mapping);
+	if (ret == 0)
+		ret = err;
+
+	if (abd->bdev) {
+		/* Not supported means there is no cache to flush */
+		err = blkdev_issue_flush(abd->bdev, NULL);
+		if (err == -EOPNOTSUPP)
+			err = 0;
+	} else if (fp->f_op && fp->f_op->fsync) {
+		/* The same as fsync(), for the metadata of the file */
+		mutex_lock(&mapping->host->i_mutex);
+		err = fp->f_op->fsync(fp, fp->f_path.dentry, 1);
+		mutex_unlock(&mapping->host->i_mutex);
+	} else
+		err = 0;
+	if (ret == 0)
+		ret = err;
+
+	return (ret);
+}
+
+/* Handle a flush cache command, everything acknowledged so far is 
+ * written to the backing device before the reply is sent. The flush is
+ * shared with the other flushes around, see aoeflush.c. */
+int bldev_flush(struct aoerequest *work)
+{
+	work->t_io = ktime_get();
+	aoe_trace(aoeserver_io_submit, work->aoereq);
+
+	aoeflush_request(work);
+
+	return (0);
+}
+
+/* Fill in the config reply template of a device. Called with tmpl_lock
+ * held, or before the device has been published. */
+void bldev_buildcfg(struct aoeblkdev *abd)
+{
+	aoeproto_buildcfg(&abd->cfg, abd->cfg_len, abd->qdepth);
+}
+
+/* Build the data of the identify reply, this only has to be done again
+ * when the size of the device changes. Called with tmpl_lock held, or
+ * before the device has been published. */
+void bldev_buildid(struct aoeblkdev *abd)
+{
+	aoeproto_buildid(abd->id, abd->size, abd->name,
+			 abd->wc.mode == AOE_WC_BACK);
+}
+
 /* This function replies to an 'identify'-request */
 int bldev_identify(struct aoerequest *work)
 {
-	struct hd_driveid *id;	/* see linux/hdreg.h */
-
 	/* Verify against acl */
 	if (aoeblock_acl(work->abd, work->aoereq->eth.h_source) != 0) {
 		aoereq_destroy(work);
@@ -437,34 +1430,12 @@ int bldev_identify(struct aoerequest *work)
 	/* Allocate space for our reply */
 	skb_put(work->skb_rep, 512);
 
-	/* Create a pointer to the data-section of the reply */
-	id = (struct hd_driveid *)((char *)work->atareply +
-				   sizeof(struct aoe_atahdr));
-
-	/* zero out everything */
-	memset(id, 0, 512);
-
-	strcpy(id->model, "123456789");
-	strncpy(id->serial_no, work->abd->name, 19);
-
-	/* Set up plain old CHS, its obsolete, but the aoe-client for 
-	 * Linux sometimes uses it, so we fill out the fields anyway.
-	 * This wont be all that accurate, but i thinks it will work */
-	id->cur_cyls = __cpu_to_le16(((work->abd->size >> 8) >> 6));
-	id->cur_heads = __cpu_to_le16(255);
-	id->cur_sectors = __cpu_to_le16(64);
-
-	/* We support LBA */
-	id->capability |= __cpu_to_le16(2);   /* Seccond bit == supports LBA */
-	if (work->abd->size > MAXATALBA)
-		id->lba_capacity = cpu_to_le32(MAXATALBA);
-	else
-		id->lba_capacity = cpu_to_le32(work->abd->size);
-
-	/* We support LBA 48 */
-	id->command_set_2 |= __cpu_to_le16(((1 << 10))); /* We support LBA48 */
-	id->cfs_enable_2  |= __cpu_to_le16(((1 << 10))); /* We use LBA48 */
-	id->lba_capacity_2 = __cpu_to_le64(work->abd->size);
+	/* The reply is prepared already, the data-section of the reply
+	 * follows the ata-header */
+	spin_lock_bh(&work->abd->tmpl_lock);
+	aoeproto_idreply((u8 *)work->atareply + sizeof(struct aoe_atahdr),
+			 work->abd->id, aoenet_maxsect(work->ifp));
+	spin_unlock_bh(&work->abd->tmpl_lock);
 
 	/* We are done, queue reply for transfer */
 	aoexmit(work);
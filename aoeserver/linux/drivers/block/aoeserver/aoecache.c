@@ -0,0 +1,238 @@
+/*
+ *  linux/drivers/block/aoeserver/aoecache.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file make up the write cache of an exported
+ * device. A frame carries at most a few sectors, so an initiator writing
+ * a large sequential stream sends us lots of small writes at adjacent
+ * addresses. With the cache enabled these are gathered in a buffer and
+ * written to the backing device as one large write, when a write comes
+ * in that doesnt continue the gathered extent, when the buffer is full or
+ * when AOE_WC_WINDOW has passed since the first write was gathered.
+ *
+ * In write-through mode the replies to the gathered writes are held back
+ * until the data has been written, in write-back mode the writes are
+ * acknowledged as soon as the data has been copied to the buffer. A
+ * write-back failure is reported to the next flush cache command. Reads
+ * of gathered sectors write the buffer out first.
+ *
+ * Everything here runs in process context, from kaoed or from the
+ * delayed work on aoe_iowq that ends the window.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/skbuff.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "aoe.h"
+
+/* Write out the gathered extent and send the replies that were held back
+ * for it. Called with the cache lock held. */
+static void aoecache_writeout(struct aoeblkdev *abd)
+{
+	struct aoecache *wc = &abd->wc;
+	struct aoerequest *work, *n;
+	unsigned int len = wc->nsect * 512;
+	ssize_t ret;
+
+	if (wc->nsect == 0)
+		return;
+
+	/* If the window is ending right now, it will find nothing to do */
+	cancel_delayed_work(&wc->work);
+
+	ret = bldev_write_buf(abd, wc->buf, len, wc->lba * 512);
+	if (ret != len)
+		ret = ret < 0 ? ret : -EIO;
+
+	aoestats_add(abd->stats, AOESTAT_WCFLUSH, 1);
+	wc->nsect = 0;
+
+	/* Write-back, nobody is waiting to hear about this */
+	if (list_empty(&wc->held)) {
+		if (ret < 0) {
+			aoestats_add(abd->stats, AOESTAT_IOERR, 1);
+			wc->error = ret;
+		}
+		return;
+	}
+
+	list_for_each_entry_safe(work, n, &wc->held, list) {
+		list_del(&work->list);
+
+		len = work->atarequest->nsect * 512;
+		bldev_status(work, ret < 0 ? ret : len, len);
+
+		aoe_trace(aoeserver_io_complete, work->aoereq);
+		aoexmit(work);
+	}
+}
+
+/* The window is over, write out whatever has been gathered */
+static void aoecache_timer(struct work_struct *work)
+{
+	struct aoeblkdev *abd = container_of(work, struct aoeblkdev,
+					     wc.work.work);
+
+	mutex_lock(&abd->wc.lock);
+	aoecache_writeout(abd);
+	mutex_unlock(&abd->wc.lock);
+}
+
+/* Gather a write of len bytes at sector lba, the data is found offset
+ * bytes into the request skb. Returns zero if the cache took the write,
+ * the reply is then sent by the cache. Returns -1 if the cache is off,
+ * the caller writes the data itself. */
+int aoecache_write(struct aoerequest *work, unsigned int offset,
+		   unsigned int len, u64 lba)
+{
+	struct aoeblkdev *abd = work->abd;
+	struct aoecache *wc = &abd->wc;
+
+	if (wc->mode == AOE_WC_OFF || len == 0)
+		return (-1);
+
+	mutex_lock(&wc->lock);
+
+	/* Turned off while we were on our way here */
+	if (wc->mode == AOE_WC_OFF) {
+		mutex_unlock(&wc->lock);
+		return (-1);
+	}
+
+	/* Only a write that continues the extent can be added to it */
+	if (wc->nsect && (lba != wc->lba + wc->nsect ||
+			  wc->nsect + len / 512 > AOE_WC_MAXSECT))
+		aoecache_writeout(abd);
+
+	if (skb_copy_bits(work->skb_req, offset, wc->buf + wc->nsect * 512,
+			  len) != 0) {
+		mutex_unlock(&wc->lock);
+		return (-1);
+	}
+
+	if (wc->nsect == 0) {
+		wc->lba = lba;
+		queue_delayed_work(aoe_iowq, &wc->work, AOE_WC_WINDOW);
+	}
+	wc->nsect += len / 512;
+
+	aoestats_inc(work, AOESTAT_WCWRITE);
+
+	if (wc->mode == AOE_WC_BACK) {
+		aoe_trace(aoeserver_io_complete, work->aoereq);
+		aoexmit(work);
+	} else
+		list_add_tail(&work->list, &wc->held);
+
+	if (wc->nsect == AOE_WC_MAXSECT)
+		aoecache_writeout(abd);
+
+	mutex_unlock(&wc->lock);
+
+	return (0);
+}
+
+/* A read of nsect sectors at lba is about to be done, write out the
+ * gathered extent first if the read covers any of it */
+void aoecache_read(struct aoeblkdev *abd, u64 lba, unsigned int nsect)
+{
+	struct aoecache *wc = &abd->wc;
+
+	if (wc->mode == AOE_WC_OFF)
+		return;
+
+	mutex_lock(&wc->lock);
+	if (wc->nsect && lba < wc->lba + wc->nsect && lba + nsect > wc->lba)
+		aoecache_writeout(abd);
+	mutex_unlock(&wc->lock);
+}
+
+/* Write out the gathered extent, for the flush cache command. Returns
+ * the error of a failed write-back since the last flush, if any. */
+int aoecache_flush(struct aoeblkdev *abd)
+{
+	struct aoecache *wc = &abd->wc;
+	int ret;
+
+	mutex_lock(&wc->lock);
+	aoecache_writeout(abd);
+	ret = wc->error;
+	wc->error = 0;
+	mutex_unlock(&wc->lock);
+
+	return (ret);
+}
+
+/* Change the mode of the cache, anything gathered in the old mode is
+ * written out first */
+int aoecache_setmode(struct aoeblkdev *abd, int mode)
+{
+	struct aoecache *wc = &abd->wc;
+	int ret = 0;
+
+	mutex_lock(&wc->lock);
+
+	if (mode != AOE_WC_OFF && wc->buf == NULL) {
+		wc->buf = vmalloc(AOE_WC_MAXSECT * 512);
+		if (wc->buf == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	aoecache_writeout(abd);
+	wc->mode = mode;
+
+	if (mode == AOE_WC_OFF) {
+		vfree(wc->buf);
+		wc->buf = NULL;
+	}
+
+      out:
+	mutex_unlock(&wc->lock);
+	return (ret);
+}
+
+void aoecache_init(struct aoeblkdev *abd)
+{
+	struct aoecache *wc = &abd->wc;
+
+	mutex_init(&wc->lock);
+	wc->mode = AOE_WC_OFF;
+	INIT_LIST_HEAD(&wc->held);
+	INIT_DELAYED_WORK(&wc->work, aoecache_timer);
+}
+
+/* The device is going away and no requests are left, write out what the
+ * cache still holds */
+void aoecache_exit(struct aoeblkdev *abd)
+{
+	struct aoecache *wc = &abd->wc;
+
+	cancel_delayed_work_sync(&wc->work);
+
+	mutex_lock(&wc->lock);
+	aoecache_writeout(abd);
+	if (wc->error)
+		printk(KERN_ERR "aoeserver: %s: write-back failed, %d\n",
+		       abd->name, wc->error);
+	vfree(wc->buf);
+	wc->buf = NULL;
+	mutex_unlock(&wc->lock);
+}
@@ -0,0 +1,135 @@
+/*
+ *  linux/drivers/block/aoeserver/aoeflush.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file answer flush cache commands and fua writes,
+ * which are only acknowledged once everything written before them is
+ * stable. Flushing the backing device is slow and covers every write
+ * that completed before it started, so flushes are done as a group
+ * commit by the flush work of the device:
+ *
+ * - kaoed only puts a request that wants a flush on the list of the
+ *   device and queues the flush work on aoe_flushwq, it never waits for
+ *   the disk itself, so the other devices served by the same cpu go on.
+ * - The flush work takes everything on the list at once, does one
+ *   flush for all of it and hands the replies back to kaoed. Requests
+ *   that arrive while it is flushing wait for the next round, which
+ *   starts after they came.
+ * - With a window set, the work waits that long before it takes the
+ *   list, so that more initiators can join the flush.
+ *
+ * aoe_flushwq has one thread per cpu shared by all devices, see aoewq.c.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+
+#include "aoe.h"
+
+/* Flush the device, returns zero or the first error */
+static int aoeflush_sync(struct aoeblkdev *abd)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = bldev_sync(abd);
+	aoestats_hist(abd->stats, AOEHIST_FLUSH, start, ktime_get());
+	aoestats_add(abd->stats, AOESTAT_FLUSH, 1);
+
+	return (ret);
+}
+
+/* Send the reply to a flush, or to a fua write, once the flush is done */
+static void aoeflush_reply(struct aoerequest *work, int ret)
+{
+	if (ret != 0)
+		bldev_status(work, ret, 0);
+
+	aoe_trace(aoeserver_io_complete, work->aoereq);
+	aoexmit(work);
+}
+
+/* Runs in kaoed once the flush a request waited for is done */
+static void aoeflush_done(struct aoerequest *work)
+{
+	aoeflush_reply(work, work->error);
+}
+
+/* The flush work, does one flush for every request that is waiting
+ * and hands the replies back to kaoed */
+static void aoeflush_work(struct work_struct *ws)
+{
+	struct aoeblkdev *abd = container_of(ws, struct aoeblkdev, fl.work);
+	struct aoeflush *fl = &abd->fl;
+	struct aoerequest *work, *n;
+	LIST_HEAD(group);
+	int ret;
+
+	/* Flushes that arrive in the window join this one */
+	if (fl->window)
+		schedule_timeout_uninterruptible(usecs_to_jiffies(fl->window));
+
+	spin_lock(&fl->lock);
+	list_splice_init(&fl->waiting, &group);
+	spin_unlock(&fl->lock);
+
+	/* Taken by the round before us */
+	if (list_empty(&group))
+		return;
+
+	ret = aoeflush_sync(abd);
+
+	list_for_each_entry_safe(work, n, &group, list) {
+		list_del(&work->list);
+		work->error = ret;
+		aoewq_queue(work, aoeflush_done);
+	}
+}
+
+/* A flush cache command, or a fua write that has been written, wants
+ * everything before it to be stable. The reply is sent by kaoed once the
+ * flush work has flushed the device. */
+void aoeflush_request(struct aoerequest *work)
+{
+	struct aoeflush *fl = &work->abd->fl;
+
+	aoestats_inc(work, AOESTAT_FLUSHREQ);
+
+	spin_lock(&fl->lock);
+	list_add_tail(&work->list, &fl->waiting);
+	spin_unlock(&fl->lock);
+
+	queue_work(aoe_flushwq, &fl->work);
+}
+
+void aoeflush_init(struct aoeblkdev *abd)
+{
+	struct aoeflush *fl = &abd->fl;
+
+	spin_lock_init(&fl->lock);
+	INIT_LIST_HEAD(&fl->waiting);
+	INIT_WORK(&fl->work, aoeflush_work);
+	fl->window = 0;
+}
+
+/* The device is going away, every request has been answered but the
+ * flush work may not have returned yet */
+void aoeflush_exit(struct aoeblkdev *abd)
+{
+	cancel_work_sync(&abd->fl.work);
+}
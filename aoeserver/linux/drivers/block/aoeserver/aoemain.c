@@ -28,7 +28,22 @@ MODULE_DESCRIPTION("ATA over Ethernet storage target driver");
 
 static int __init aoe_init(void)
 {
+	if (aoewq_cacheinit() != 0)
+		return (-ENOMEM);
+
+	if (aoewq_startworkers() != 0) {
+		aoewq_cacheexit();
+		return (-ENOMEM);
+	}
+
+	if (aoewq_startqueues() != 0) {
+		aoewq_stopworkers();
+		aoewq_cacheexit();
+		return (-ENOMEM);
+	}
+
 	aoeproc_init();
+	aoestats_init();
 	return (0);
 }
 
@@ -36,7 +51,13 @@ static void aoe_exit(void)
 {
 
 	aoeblock_exit();
+	aoestats_exit();
 	aoeproc_exit();
+	aoenet_ifexit();
+	aoeskb_exit();
+	aoewq_stopqueues();
+	aoewq_stopworkers();
+	aoewq_cacheexit();
 }
 
 module_init(aoe_init);
@@ -20,26 +20,482 @@
 #include <linux/skbuff.h>
 #include <linux/netdevice.h>
 #include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 
 #include "aoe.h"
 
-/* Both these are from aoeblock.c */
-extern struct aoeblkdev *abd_head;
-extern rwlock_t abd_lock;
-
 /* Counter for how many devices we have exported */
 atomic_t active_devices = ATOMIC_INIT(0);
 
+/* Per interface settings, readers use rcu, writers hold aoeif_lock */
+static LIST_HEAD(aoeif_list);
+static DEFINE_SPINLOCK(aoeif_lock);
+
+static void aoeif_statswork(struct work_struct *unused);
+static DECLARE_WORK(aoeif_stats_work, aoeif_statswork);
+
+static void aoeif_replieswork(struct work_struct *unused);
+static DECLARE_WORK(aoeif_replies_work, aoeif_replieswork);
+
+/* Bumped whenever something that goes into a discovery reply changes */
+static atomic_t aoe_discover_gen = ATOMIC_INIT(0);
+
+/* Find the settings for an interface, the caller must be inside 
+ * rcu_read_lock() or hold aoeif_lock. Returns NULL for interfaces that
+ * have never been configured, they use the defaults. */
+static struct aoeif *aoeif_find(int ifindex)
+{
+	struct aoeif *aif;
+
+	list_for_each_entry_rcu(aif, &aoeif_list, list)
+	    if (aif->ifindex == ifindex)
+		return (aif);
+
+	return (NULL);
+}
+
+/* Give the interfaces that dont have counters yet their counters. The
+ * counters are cpu local memory, which can only be had in process
+ * context. Until they are there an interface just isnt counted. */
+static void aoeif_statswork(struct work_struct *unused)
+{
+	struct aoestats *st;
+	struct aoeif *aif;
+	int ifindex;
+
+	for (;;) {
+		ifindex = 0;
+		rcu_read_lock();
+		list_for_each_entry_rcu(aif, &aoeif_list, list)
+		    if (aif->stats == NULL) {
+			ifindex = aif->ifindex;
+			break;
+		}
+		rcu_read_unlock();
+
+		if (ifindex == 0)
+			return;
+
+		st = aoestats_alloc();
+		if (st == NULL)
+			return;
+
+		spin_lock_bh(&aoeif_lock);
+		aif = aoeif_find(ifindex);
+		if (aif && aif->stats == NULL) {
+			rcu_assign_pointer(aif->stats, st);
+			st = NULL;
+		}
+		spin_unlock_bh(&aoeif_lock);
+
+		aoestats_free(st);
+	}
+}
+
+/* Find the settings for an interface, creating them if needed. Called
+ * with aoeif_lock held. */
+static struct aoeif *aoeif_get(int ifindex)
+{
+	struct aoeif *aif;
+
+	if ((aif = aoeif_find(ifindex)))
+		return (aif);
+
+	aif = kzalloc(sizeof(*aif), GFP_ATOMIC);
+	if (aif == NULL)
+		return (NULL);
+
+	aif->ifindex = ifindex;
+	aif->stats = NULL;	/* Until aoeif_statswork() has run */
+	spin_lock_init(&aif->lock);
+	skb_queue_head_init(&aif->replies);
+
+	/* Make sure the replies are built on first use */
+	aif->gen = atomic_read(&aoe_discover_gen) - 1;
+
+	list_add_rcu(&aif->list, &aoeif_list);
+
+	/* We may be in softirq-context, the counters are allocated later */
+	schedule_work(&aoeif_stats_work);
+
+	return (aif);
+}
+
+/* Find the settings for the interface a frame came in on, creating them
+ * on the first frame. Called from aoenet_rcv() inside rcu_read_lock(). */
+static struct aoeif *aoeif_lookup(int ifindex)
+{
+	struct aoeif *aif;
+
+	if ((aif = aoeif_find(ifindex)))
+		return (aif);
+
+	spin_lock(&aoeif_lock);
+	aif = aoeif_get(ifindex);
+	spin_unlock(&aoeif_lock);
+
+	return (aif);
+}
+
+/* Choose if replies on an interface are handed directly to the driver
+ * or go through the qdisc like all other traffic */
+int aoenet_setxmit(int ifindex, int direct)
+{
+	struct aoeif *aif;
+
+	spin_lock_bh(&aoeif_lock);
+	aif = aoeif_get(ifindex);
+	if (aif)
+		aif->direct = direct;
+	spin_unlock_bh(&aoeif_lock);
+
+	return (aif ? 0 : -ENOMEM);
+}
+
+/* Print the interface settings in /proc/aoeserver */
+void aoenet_seq_show(struct seq_file *s)
+{
+	struct net_device *dev;
+	struct aoeif *aif;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(aif, &aoeif_list, list)
+	    if ((dev = dev_get_by_index(&init_net, aif->ifindex))) {
+		seq_printf(s, "%-14s %s\n", dev->name,
+			   aif->direct ? "direct" : "queue");
+		dev_put(dev);
+	}
+	rcu_read_unlock();
+}
+
+/* Print the interface counters in the stats file */
+void aoenet_stats_show(struct seq_file *s)
+{
+	struct net_device *dev;
+	struct aoeif *aif;
+	char prefix[IFNAMSIZ + 4];
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(aif, &aoeif_list, list)
+	    if ((dev = dev_get_by_index(&init_net, aif->ifindex))) {
+		snprintf(prefix, sizeof(prefix), "if.%s", dev->name);
+		dev_put(dev);
+		aoestats_show(s, prefix, aif->stats);
+	}
+	rcu_read_unlock();
+}
+
+/* Free the interface settings when the module is unloaded */
+void aoenet_ifexit(void)
+{
+	struct aoeif *aif, *n;
+	LIST_HEAD(dead);
+
+	cancel_work_sync(&aoeif_stats_work);
+	cancel_work_sync(&aoeif_replies_work);
+
+	spin_lock_bh(&aoeif_lock);
+	list_for_each_entry_safe(aif, n, &aoeif_list, list) {
+		list_del_rcu(&aif->list);
+		list_add(&aif->list, &dead);
+	}
+	spin_unlock_bh(&aoeif_lock);
+
+	/* Wait for aoenet_xmit() and friends to let go of them */
+	synchronize_rcu();
+
+	list_for_each_entry_safe(aif, n, &dead, list) {
+		skb_queue_purge(&aif->replies);
+		aoestats_free(aif->stats);
+		kfree(aif);
+	}
+}
+
+/* Return the number of sectors that fit in one frame on this interface */
+int aoenet_maxsect(struct net_device *ifp)
+{
+	return (aoeproto_maxsect(ifp->mtu));
+}
+
+/* Make sure the aoe-header and the ata or cfg header are in the linear
+ * part of the skb. Write data is left in the page fragments, it is 
+ * written to disk straight from them by bldev_transfer(). */
 static struct sk_buff *skb_check(struct sk_buff *skb)
 {
-	if (skb_is_nonlinear(skb))
-		if ((skb = skb_share_check(skb, GFP_ATOMIC)))
-			if (skb_linearize(skb) < 0) {
-				dev_kfree_skb(skb);
-				return NULL;
-			}
+	unsigned int hlen = sizeof(struct aoe_hdr) - ETH_HLEN;
+	struct aoe_hdr *h;
+
+	if (!skb_is_nonlinear(skb))
+		return skb;
+
+	if ((skb = skb_share_check(skb, GFP_ATOMIC)) == NULL)
+		return NULL;
+
+	if (!pskb_may_pull(skb, hlen))
+		goto fail;
+
+	h = (struct aoe_hdr *)skb_mac_header(skb);
+	if (h->cmd == AOE_CMD_ATA) {
+		if (!pskb_may_pull(skb, hlen + sizeof(struct aoe_atahdr)))
+			goto fail;
+	} else if (skb_linearize(skb) < 0)	/* cfg requests are small */
+		goto fail;
+
 	return skb;
+
+      fail:
+	dev_kfree_skb(skb);
+	return NULL;
+}
+
+/* Called when a device is added or removed, or its config string or 
+ * queue depth changes. The discovery replies are rebuilt in process 
+ * context by aoeif_replieswork(), may be called with spinlocks held. */
+void aoenet_changed(void)
+{
+	atomic_inc(&aoe_discover_gen);
+	schedule_work(&aoeif_replies_work);
+}
+
+/* Build the config reply a device sends to a discovery query on ifp,
+ * everything but the destination, tag and config command is filled in */
+static struct sk_buff *aoenet_cfgreply(struct net_device *ifp,
+				       struct aoeblkdev *abd)
+{
+	struct sk_buff *skb;
+	struct aoe_hdr *h;
+	struct aoe_cfghdr *cfg;
+	unsigned int len;
+
+	/* Room for the longest config string, it may change under us */
+	len = sizeof(*h) + sizeof(abd->cfg);
+
+	skb = alloc_skb(len + LL_RESERVED_SPACE(ifp), GFP_KERNEL);
+	if (skb == NULL)
+		return (NULL);
+
+	skb_reserve(skb, LL_RESERVED_SPACE(ifp));
+	skb_reset_mac_header(skb);
+	skb_reset_network_header(skb);
+	skb->protocol = __constant_htons(PRIV_ETH_P_AOE);
+	skb->dev = ifp;
+
+	h = (struct aoe_hdr *)skb_put(skb, sizeof(*h));
+	memset(h, 0, sizeof(*h));
+	memcpy(h->eth.h_source, ifp->dev_addr, ETH_ALEN);
+	h->eth.h_proto = __constant_htons(PRIV_ETH_P_AOE);
+	h->ver_flags = 0x10 | AOE_FLAG_RSP;	/* AOE Version one */
+	h->shelf = htons(abd->shelf);
+	h->slot = abd->slot;
+	h->cmd = AOE_CMD_CFG;
+
+	/* The config header and string come from the template */
+	cfg = (struct aoe_cfghdr *)skb_tail_pointer(skb);
+	spin_lock_bh(&abd->tmpl_lock);
+	len = aoeproto_cfgreply(cfg, &abd->cfg, abd->cfg_len, 0,
+				aoenet_maxsect(ifp));
+	spin_unlock_bh(&abd->tmpl_lock);
+	skb_put(skb, len);
+
+	return (skb);
+}
+
+/* Build the discovery replies of the devices exported on ifp on q.
+ * Returns -1 if we ran out of memory. */
+static int aoenet_buildreplies(struct sk_buff_head *q, struct net_device *ifp)
+{
+	struct aoeblkdev *abd;
+	struct sk_buff *skb;
+
+	mutex_lock(&abd_mutex);
+	list_for_each_entry(abd, &abd_list, list) {
+		if (abd->ifindex != 0 && abd->ifindex != ifp->ifindex)
+			continue;
+
+		if ((skb = aoenet_cfgreply(ifp, abd)) == NULL) {
+			mutex_unlock(&abd_mutex);
+			skb_queue_purge(q);
+			return (-1);
+		}
+
+		__skb_queue_tail(q, skb);
+	}
+	mutex_unlock(&abd_mutex);
+
+	return (0);
+}
+
+/* Rebuild the discovery replies of the interfaces whose replies are out
+ * of date. The replies are allocated here, aoenet_discover() only uses
+ * them once they are swapped in. */
+static void aoeif_replieswork(struct work_struct *unused)
+{
+	struct sk_buff_head q, old;
+	struct net_device *ifp;
+	struct sk_buff *skb;
+	struct aoeif *aif;
+	unsigned int mtu;
+	int ifindex, gen, ret;
+
+	for (;;) {
+		gen = atomic_read(&aoe_discover_gen);
+		ifindex = 0;
+		rcu_read_lock();
+		list_for_each_entry_rcu(aif, &aoeif_list, list)
+		    if (aif->gen != gen) {
+			ifindex = aif->ifindex;
+			break;
+		}
+		rcu_read_unlock();
+
+		if (ifindex == 0)
+			return;
+
+		/* An interface that is gone gets no replies */
+		skb_queue_head_init(&q);
+		mtu = 0;
+		if ((ifp = dev_get_by_index(&init_net, ifindex))) {
+			mtu = ifp->mtu;
+			ret = aoenet_buildreplies(&q, ifp);
+			dev_put(ifp);
+
+			/* kaoed answers until the next change */
+			if (ret != 0)
+				return;
+		}
+
+		skb_queue_head_init(&old);
+		rcu_read_lock();
+		if ((aif = aoeif_find(ifindex))) {
+			spin_lock_bh(&aif->lock);
+			while ((skb = __skb_dequeue(&aif->replies)) != NULL)
+				__skb_queue_tail(&old, skb);
+			while ((skb = __skb_dequeue(&q)) != NULL)
+				__skb_queue_tail(&aif->replies, skb);
+			aif->gen = gen;
+			aif->mtu = mtu;
+			spin_unlock_bh(&aif->lock);
+		}
+		rcu_read_unlock();
+
+		skb_queue_purge(&old);
+		skb_queue_purge(&q);
+	}
+}
+
+/* Rate limit discovery queries per initiator. Returns 0 if the query 
+ * should be answered. Called with aif->lock held. */
+static int aoenet_ratelimit(struct aoeif *aif, unsigned char *h_source)
+{
+	unsigned int i = jhash(h_source, ETH_ALEN, 0) % AOE_DISC_HASH;
+
+	if (memcmp(aif->seen[i].h_source, h_source, ETH_ALEN) == 0 &&
+	    time_before(jiffies, aif->seen[i].when + AOE_DISC_INTERVAL))
+		return (-1);
+
+	memcpy(aif->seen[i].h_source, h_source, ETH_ALEN);
+	aif->seen[i].when = jiffies;
+
+	return (0);
+}
+
+/* Answer a broadcast config query from the prebuilt replies of the
+ * interface, in one pass and without touching the device queues.
+ * Returns -1 if this isnt a query we handle here. Called in softirq-
+ * context inside rcu_read_lock(), the request skb is linear. */
+static int aoenet_discover(struct sk_buff *skb, struct net_device *ifp)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)skb_mac_header(skb);
+	struct aoe_cfghdr *request, *cfg;
+	struct sk_buff_head out;
+	struct sk_buff *tmpl, *rep;
+	struct aoeblkdev *abd;
+	struct aoe_hdr *rh;
+	struct aoeif *aif;
+	unsigned char *reqdata;
+	unsigned int reqlen, len;
+	int ccmd;
+
+	if (h->cmd != AOE_CMD_CFG ||
+	    skb_tail_pointer(skb) < (unsigned char *)h + sizeof(*h) +
+	    sizeof(*request))
+		return (-1);
+
+	request = (struct aoe_cfghdr *)((unsigned char *)h + sizeof(*h));
+	reqdata = (unsigned char *)request + sizeof(*request);
+	reqlen = be16_to_cpu(request->data_len);
+
+	/* Only read and match commands, setting the config string on all
+	 * devices at once still goes through the queues */
+	ccmd = request->aoever_cmd & 0x0f;
+	if (ccmd > 2)
+		return (-1);
+
+	/* kaoed answers those with a bad argument error */
+	if (reqdata + reqlen > skb_tail_pointer(skb))
+		return (-1);
+
+	aif = aoeif_lookup(ifp->ifindex);
+	if (aif == NULL)
+		return (-1);
+
+	skb_queue_head_init(&out);
+
+	spin_lock(&aif->lock);
+
+	/* Replies that are out of date are rebuilt in process context,
+	 * kaoed answers until they are ready */
+	if (aif->mtu != ifp->mtu)
+		aif->gen = atomic_read(&aoe_discover_gen) - 1;
+	if (aif->gen != atomic_read(&aoe_discover_gen)) {
+		spin_unlock(&aif->lock);
+		schedule_work(&aoeif_replies_work);
+		return (-1);
+	}
+
+	if (aoenet_ratelimit(aif, h->eth.h_source) != 0) {
+		spin_unlock(&aif->lock);
+		return (0);
+	}
+
+	skb_queue_walk(&aif->replies, tmpl) {
+		rh = (struct aoe_hdr *)tmpl->data;
+		cfg = (struct aoe_cfghdr *)(tmpl->data + sizeof(*rh));
+		len = be16_to_cpu(cfg->data_len);
+
+		/* The device may be gone, and it may hide from this host */
+		abd = find_aoedevice(ntohs(rh->shelf), rh->slot, ifp->ifindex);
+		if (abd == NULL || aoeblock_acl(abd, h->eth.h_source) != 0)
+			continue;
+
+		if (!aoeproto_cfgmatch(ccmd, (u8 *)cfg + sizeof(*cfg), len,
+				       reqdata, reqlen))
+			continue;
+
+		if ((rep = skb_copy(tmpl, GFP_ATOMIC)) == NULL)
+			break;
+
+		rh = (struct aoe_hdr *)rep->data;
+		memcpy(rh->eth.h_dest, h->eth.h_source, ETH_ALEN);
+		rh->tag = h->tag;
+		cfg = (struct aoe_cfghdr *)(rep->data + sizeof(*rh));
+		cfg->aoever_cmd = 0x10 | ccmd;
+
+		__skb_queue_tail(&out, rep);
+		aoestats_add(aif->stats, AOESTAT_TX, 1);
+	}
+
+	spin_unlock(&aif->lock);
+
+	while ((rep = __skb_dequeue(&out)) != NULL)
+		dev_queue_xmit(rep);
+
+	return (0);
 }
 
 /* This function is called when a new packet is recieved, it runs 
@@ -49,18 +505,29 @@ aoenet_rcv(struct sk_buff *skb, struct net_device *ifp, struct packet_type *pt)
 {
 	struct aoe_hdr *h;
 	struct aoeblkdev *abd = NULL;
+	struct aoeif *aif;
 	unsigned short shelf;
 	unsigned short slot;
 
+	/* The device list is rcu-protected, aoeblock_unregister() waits
+	 * for us to leave this section before it flushes the queue */
+	rcu_read_lock();
+
+	aif = aoeif_lookup(ifp->ifindex);
+	if (aif)
+		aoestats_add(aif->stats, AOESTAT_RX, 1);
+
 	skb = skb_check(skb);
 	if (!skb)
-		goto out;
+		goto out_drop;
 
 	h = (struct aoe_hdr *)skb->mac_header;
 
-	if ((h->ver_flags & AOE_FLAG_RSP) == 1)
+	if (h->ver_flags & AOE_FLAG_RSP)
 		goto out_kfree_skb; /* This was a responce packet */
 
+	aoe_trace(aoeserver_rcv, h);
+
 	/* Retrieve major and minor */
 	shelf = ntohs(h->shelf);
 	slot = h->slot;
@@ -72,22 +539,27 @@ aoenet_rcv(struct sk_buff *skb, struct net_device *ifp, struct packet_type *pt)
 			goto out_kfree_skb;	/* Invalid interface */
 
 		/* If so, put it in the queue for processing */
-		aoewq_addreq(skb, ifp, abd);
+		aoewq_addreq(skb, ifp, aif, abd);
 		goto out;
 	} else {
-		if ((shelf == 0xffff) && (slot == 0x00ff) && (abd_head != NULL)) {
-			/* This was a broadcast, so we send the same packet to
+		if ((shelf == 0xffff) && (slot == 0x00ff)) {
+			/* Discovery queries are answered right here */
+			if (aoenet_discover(skb, ifp) == 0) {
+				dev_kfree_skb(skb);
+				goto out;
+			}
+
+			/* Any other broadcast, so we send the same packet to
 			 * all queues and inc the ref-counter on the skb */
-			read_lock(&abd_lock);
-			list_for_each_entry(abd, &abd_head->list, list)
+			list_for_each_entry_rcu(abd, &abd_list, list)
 			    if (abd->ifindex == 0
 				|| abd->ifindex == ifp->ifindex) {
 				atomic_inc(&skb->users);
-				aoewq_addreq(skb, ifp, abd);
+				aoewq_addreq(skb, ifp, aif, abd);
 			}
-			read_unlock(&abd_lock);
 
-			/* Subtle - Will now fall through to dev_kfree_skb() */
+			dev_kfree_skb(skb);
+			goto out;
 
 		} else
 			printk(KERN_INFO
@@ -99,10 +571,100 @@ aoenet_rcv(struct sk_buff *skb, struct net_device *ifp, struct packet_type *pt)
       out_kfree_skb:
 	dev_kfree_skb(skb);
 
+      out_drop:
+	if (aif)
+		aoestats_add(aif->stats, AOESTAT_DROP, 1);
+
       out:
+	rcu_read_unlock();
 	return (0);
 }
 
+/* Check if the driver can take a reply as it is. dev_queue_xmit()
+ * linearizes a fragmented skb for a device without scatter/gather, or
+ * one with page cache pages in highmem the device cant dma from, those
+ * replies have to go through it. Drivers doing their own tx locking
+ * arent serialized by the tx lock we hold, they always go through it. */
+static int aoenet_xmit_ok(struct net_device *dev, struct sk_buff *skb)
+{
+	int i;
+
+	if (dev->features & NETIF_F_LLTX)
+		return (0);
+
+	if (skb_shinfo(skb)->frag_list || skb_is_gso(skb))
+		return (0);
+
+	if (skb_shinfo(skb)->nr_frags == 0)
+		return (1);
+
+	if (!(dev->features & NETIF_F_SG))
+		return (0);
+
+	/* PageHighMem() is zero without highmem */
+	if (!(dev->features & NETIF_F_HIGHDMA))
+		for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
+			if (PageHighMem(skb_shinfo(skb)->frags[i].page))
+				return (0);
+
+	return (1);
+}
+
+/* Hand a run of replies for the same interface straight to the driver, 
+ * skipping the qdisc, the way pktgen does. The tx lock is taken once for
+ * the whole run. Whatever the driver doesnt take, or cant take as it is,
+ * goes through the qdisc.
+ * skb has been dequeued from q, more skbs for dev are taken from q. */
+static void aoenet_xmit_direct(struct net_device *dev, struct sk_buff *skb,
+			       struct sk_buff_head *q)
+{
+	netif_tx_lock_bh(dev);
+	while (skb) {
+		if (!netif_running(dev) || netif_queue_stopped(dev) ||
+		    !aoenet_xmit_ok(dev, skb))
+			break;
+
+		/* NETDEV_TX_BUSY and NETDEV_TX_LOCKED leave the skb with us,
+		 * it is requeued through the qdisc below */
+		aoe_trace(aoeserver_send, (struct aoe_hdr *)skb->data);
+		if (dev->hard_start_xmit(skb, dev) != NETDEV_TX_OK)
+			break;
+		dev->trans_start = jiffies;
+
+		skb = skb_peek(q);
+		if (skb && skb->dev == dev)
+			__skb_unlink(skb, q);
+		else
+			skb = NULL;
+	}
+	netif_tx_unlock_bh(dev);
+
+	if (skb)
+		dev_queue_xmit(skb);
+}
+
+/* Send the replies collected during one pass of a kaoed thread */
+void aoenet_xmit(struct sk_buff_head *q)
+{
+	struct sk_buff *skb;
+	struct aoeif *aif;
+	int direct;
+
+	while ((skb = __skb_dequeue(q)) != NULL) {
+		rcu_read_lock();
+		aif = aoeif_find(skb->dev->ifindex);
+		direct = aif ? aif->direct : 0;
+		rcu_read_unlock();
+
+		if (direct)
+			aoenet_xmit_direct(skb->dev, skb, q);
+		else {
+			aoe_trace(aoeserver_send, (struct aoe_hdr *)skb->data);
+			dev_queue_xmit(skb);
+		}
+	}
+}
+
 static struct packet_type aoe_pt = {
 	.type = __constant_htons(PRIV_ETH_P_AOE),
 	.func = aoenet_rcv,
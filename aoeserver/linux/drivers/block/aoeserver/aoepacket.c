@@ -32,24 +32,30 @@
 /* This is the entry-point for the workerqueue kaoed, this function takes
  * care of newly recieved aoe-packets and dispatches them either to the
  * ata-handler or to the config-handler. kaoed() runs in the process-context
- * of one of the kaoed-threads. As of now there are the only two commands 
+ * of the kaoed-thread the request was queued on. As of now there are the only two commands 
  * that are specified in the ATA over Ethernet specification (ATA & CFG) */
-void kaoed(struct work_struct *data)
+void kaoed(struct aoerequest *work)
 {
-	struct aoerequest  *work    = container_of(data, struct aoerequest, work);
-
-
-	/* We are ready to handle more packets */
-	(void)aoedecqueue(work->abd);
+	ktime_t now;
 
 	/* In the skb we find our aoe request frame */
 	work->aoereq = (struct aoe_hdr *)work->skb_req->mac_header;
 
+	aoe_trace(aoeserver_dequeue, work->aoereq);
+
+	/* Time spent waiting in the queue */
+	now = ktime_get();
+	aoestats_hist(work->abd->stats, AOEHIST_QUEUE, work->t_rx, now);
+	if (work->aif)
+		aoestats_hist(work->aif->stats, AOEHIST_QUEUE, work->t_rx, now);
+
 	/* Allocate an skb reply buffer of suitable size */
 	work->skb_rep = create_skb(work->ifp, work);
 
 	if (!work->skb_rep) {
 		printk("aoepacket(): Failed to create_skb\n");
+		aoestats_inc(work, AOESTAT_NOMEM);
+		aoestats_inc(work, AOESTAT_DROP);
 		goto out;
 	}
 
@@ -84,20 +90,18 @@ void kaoed(struct work_struct *data)
 /* This function processes and replies to aoe-config requests */
 void handleconfig(struct aoerequest *work)
 {
+	struct aoeblkdev *abd = work->abd;
 	struct aoe_cfghdr *reply;
 	struct aoe_cfghdr *request;
-	unsigned char *cfgdatareq;
-	unsigned char *cfgdatarep;
+	unsigned int avail, len;
+	int ret;
 
 	/* Verify against acl */
-	if (aoeblock_acl(work->abd, work->aoereq->eth.h_source) != 0) {
+	if (aoeblock_acl(abd, work->aoereq->eth.h_source) != 0) {
 		printk("handleconfig: request blocked by acl!\n");
 		goto no_xmit;
 	}
 
-	/* Make space for our cfg-header */
-	skb_put(work->skb_rep, sizeof(struct aoe_cfghdr));
-
 	/* Point to aoehdr */
 	request =
 	    (struct aoe_cfghdr *)((unsigned char *)work->skb_req->mac_header +
@@ -106,89 +110,33 @@ void handleconfig(struct aoerequest *work)
 	    (struct aoe_cfghdr *)((unsigned char *)work->skb_rep->data +
 				  sizeof(struct aoe_hdr));
 
-	/* Point to cfg data */
-	cfgdatareq = (unsigned char *)request + sizeof(struct aoe_cfghdr);
-	cfgdatarep = (unsigned char *)reply + sizeof(struct aoe_cfghdr);
-
-	/* The number of packets we can queue */
-	reply->queuelen = cpu_to_be16(20);
-
-	reply->firmware = cpu_to_be16(0x4000);
-	reply->notused = 0;	/*reserved */
-
-	/* Copy cmd in reply */
-	reply->aoever_cmd = 0;
-	reply->aoever_cmd = request->aoever_cmd & 0x0f;
-	reply->aoever_cmd |= 0x10;	/* AOE Version one */
-
-	reply->data_len = 0;
-
-	switch (request->aoever_cmd & 0x0f) {
-	case 0:		/* read */
-		skb_put(work->skb_rep, work->abd->cfg_len);
-		memcpy(cfgdatarep, work->abd->cfg_data, work->abd->cfg_len);
-		reply->data_len = cpu_to_be16(work->abd->cfg_len);
-
-		break;		/* ---------- */
-
-	case 1:		/* respond to exact match */
-		if (memcmp(work->abd->cfg_data, cfgdatareq, work->abd->cfg_len)
-		    == 0) {
-			memcpy(cfgdatarep, work->abd->cfg_data,
-			       work->abd->cfg_len);
-			reply->data_len = cpu_to_be16(work->abd->cfg_len);
-		} else
-			goto no_xmit;
-
-		break;		/* ---------- */
-
-	case 2:		/* respond on partial match */
-		if (memcmp(work->abd->cfg_data, cfgdatareq,
-			   be16_to_cpu(request->data_len)) == 0) {
-			skb_put(work->skb_rep, work->abd->cfg_len);
-			memcpy(cfgdatarep, work->abd->cfg_data,
-			       work->abd->cfg_len);
-			reply->data_len = cpu_to_be16(work->abd->cfg_len);
-		} else
-			goto no_xmit;
-
-		break;		/* ---------- */
-
-	case 3:		/* Set config string if empty */
-
-		if (work->abd->cfg_len == 0 &&
-		    (be16_to_cpu(request->data_len) <= 1024)) {
-			memcpy(work->abd->cfg_data,
-			       cfgdatarep, be16_to_cpu(request->data_len));
-			work->abd->cfg_len = be16_to_cpu(request->data_len);
-		} else {
-			work->aoerep->ver_flags |= AOE_FLAG_ERR;
-			work->aoerep->error |= AOE_ERR_CFG_SET;
-		}
-
-		break;		/* ---------- */
-
-	case 4:		/* Set config string */
-
-		if (be16_to_cpu(request->data_len) <= 1024) {
-			memcpy(work->abd->cfg_data,
-			       cfgdatarep, be16_to_cpu(request->data_len));
-			work->abd->cfg_len = be16_to_cpu(request->data_len);
-		} else {
-			work->aoerep->ver_flags |= AOE_FLAG_ERR;
-			work->aoerep->error |= AOE_ERR_BADARG;
-		}
+	/* cfg requests are linear, see skb_check(). The config string is
+	 * only trusted as far as the frame goes, data_len may say more. */
+	if (skb_tail_pointer(work->skb_req) < (unsigned char *)(request + 1))
+		goto no_xmit;
+	avail = skb_tail_pointer(work->skb_req) - (unsigned char *)(request + 1);
 
-		break;
+	spin_lock_bh(&abd->tmpl_lock);
 
-	default:
-		work->aoerep->ver_flags |= AOE_FLAG_ERR;
-		work->aoerep->error |= AOE_ERR_BADCMD;
-		printk(KERN_ERR "handleconfig(): Unknown command: %d\n",
-		       request->aoever_cmd);
-		break;
+	ret = aoeproto_cfg(&abd->cfg, &abd->cfg_len, work->aoerep, request, avail);
+	if (ret == AOEPROTO_NOREPLY) {
+		spin_unlock_bh(&abd->tmpl_lock);
+		goto no_xmit;
+	}
+
+	if (ret == AOEPROTO_CHANGED) {
+		bldev_buildcfg(abd);
+		aoenet_changed();
 	}
 
+	/* The config header and string are ready in the template */
+	len = aoeproto_cfgreply(reply, &abd->cfg, abd->cfg_len,
+				request->aoever_cmd & 0x0f,
+				aoenet_maxsect(work->ifp));
+	skb_put(work->skb_rep, len);
+
+	spin_unlock_bh(&abd->tmpl_lock);
+
 	aoexmit(work);
 	return;
 
@@ -217,57 +165,62 @@ void handleata(struct aoerequest *work)
 	work->atareply = (struct aoe_atahdr *)
 	    ((unsigned char *)work->skb_rep->mac_header + sizeof(struct aoe_hdr));
 
-	/* Copy the ata-header from the request to the reply */
-	memcpy(work->atareply, work->atarequest, sizeof(*work->atareply));
-
-	/* So far, everything is ok */
-	work->atareply->err_feature = 0;
-	work->atareply->cmdstat = READY_STAT;
-
-	/* Santity check the sector count */
-	if (work->atarequest->nsect > 2) {
-		printk(KERN_ERR
-		       "aoe: atatransfer(): error sector count %d in req!n",
-		       work->atarequest->nsect);
-		goto error_xmit;
-	}
-
-	switch (work->atarequest->cmdstat) {
-	case WIN_READ:
-	case WIN_READ_EXT:
-	case WIN_WRITE:
-	case WIN_WRITE_EXT:
-
-		if (work->abd == NULL) {
-			printk(KERN_ERR "read/write to unknown device!!\n");
-			goto error_xmit;
-		}
-
+	/* The reply starts out as a copy of the request */
+	switch (aoeproto_atacheck(work->atarequest, work->atareply,
+				  work->maxsect, work->size)) {
+	case AOEPROTO_READ:
+	case AOEPROTO_WRITE:
 		bldev_transfer(work);
-		goto no_xmit;
 		break;
 
-	case WIN_IDENTIFY:
-
+	case AOEPROTO_IDENTIFY:
 		bldev_identify(work);
-		goto no_xmit;
 		break;
 
-	default:
+	case AOEPROTO_FLUSH:
+		bldev_flush(work);
+		break;
 
-		/* We didnt understand the command :( */
-		goto error_xmit;
+	case AOEPROTO_RANGE:
+		/* Requests beyond the end of the device are answered
+		 * right away */
+		aoestats_inc(work, AOESTAT_RANGE);
+		aoexmit(work);
 		break;
 
+	default:
+		/* We didnt understand the request :( */
+		aoexmit(work);
+		break;
 	}
+}
 
-      error_xmit:
-	work->atareply->err_feature = ABRT_ERR;
-	work->atareply->cmdstat = ERR_STAT | READY_STAT;
-	aoexmit(work);
+/* Figure out how large the reply to a request is going to be, so that
+ * create_skb() doesnt have to allocate a full frame for every reply. */
+static unsigned int create_skb_len(struct net_device *outdev,
+				   struct aoerequest *work,
+				   struct aoe_hdr *aoereq)
+{
+	struct aoe_atahdr *ata = (struct aoe_atahdr *)(aoereq + 1);
+	unsigned int len, hlen;
+
+	/* A resize or an mtu change before handleata() must not make the
+	 * reply too small for the data */
+	work->size = aoeblock_size(work->abd);
+	work->maxsect = aoenet_maxsect(outdev);
+
+	len = aoeproto_replen(aoereq, work->maxsect, work->size);
+
+	/* Page cache pages are attached as fragments instead */
+	hlen = sizeof(struct aoe_hdr) + sizeof(struct aoe_atahdr);
+	if (aoereq->cmd == AOE_CMD_ATA && aoeproto_rw(ata) == AOEPROTO_READ &&
+	    len > hlen) {
+		work->zerocopy = bldev_zerocopy(work);
+		if (work->zerocopy)
+			len = hlen;
+	}
 
-      no_xmit:
-	return;
+	return (len);
 }
 
 /* This function creates an AOE-response packet using the information in the 
@@ -278,9 +231,12 @@ void handleata(struct aoerequest *work)
  * points work->skb_rep to the same buffer */
 struct sk_buff *create_skb(struct net_device *outdev, struct aoerequest *work)
 {
-	/* We allocate ETH_FRAME_LEN(1514)-bytes since 
-	   this is the common case */
-	work->skb_rep = alloc_skb(ETH_FRAME_LEN, GFP_DMA);
+	/* Allocate just what the reply needs, with jumbo frames
+	   a read can be a lot larger than ETH_FRAME_LEN. The skb
+	   is most likely a recycled one from an earlier reply. */
+	work->zerocopy = 0;
+	work->skb_rep = aoeskb_alloc(outdev, create_skb_len(outdev, work,
+				     (struct aoe_hdr *)work->skb_req->mac_header));
 	if (!work->skb_rep) {
 		printk("create_skb(): Unable to allocate skb!\n");
 		return (NULL);
@@ -299,26 +255,15 @@ struct sk_buff *create_skb(struct net_device *outdev, struct aoerequest *work)
 	work->aoerep = (struct aoe_hdr *)work->skb_rep->data;
 	work->aoereq = (struct aoe_hdr *)work->skb_req->mac_header;
 
-	/* We copy the entire header from the request into the reply */
-	memcpy((void *)work->aoerep, (void *)work->aoereq,
-	       sizeof(struct aoe_hdr));
-
-	/* We send the reply to the source of the request */
-	memcpy(work->aoerep->eth.h_dest, work->aoereq->eth.h_source, ETH_ALEN);
-
-	/* Set src-addr to our interface address */
-	memcpy(work->aoerep->eth.h_source, outdev->dev_addr, ETH_ALEN);
+	/* We copy the header from the request into the reply and send
+	 * the reply to the source of the request */
+	aoeproto_rephdr(work->aoerep, work->aoereq, outdev->dev_addr,
+			work->abd->shelf, work->abd->slot);
 
 	/* Reply is going out on the same interface 
 	   that the request came in on */
 	work->skb_rep->dev = outdev;
 
-	work->aoerep->ver_flags |= AOE_FLAG_RSP;	/* response flag */
-
-	/* Set the appropriate major and minor number */
-	work->aoerep->shelf = htons(work->abd->shelf);
-	work->aoerep->slot = work->abd->slot;
-
 	return (work->skb_rep);
 }
 
@@ -326,8 +271,14 @@ struct sk_buff *create_skb(struct net_device *outdev, struct aoerequest *work)
  * Since it uses dev_queue_xmit it can not be used from interrupt context */
 void aoexmit(struct aoerequest *work)
 {
-	dev_queue_xmit(work->skb_rep);
-	work->skb_rep = NULL;
+	aoe_trace(aoeserver_xmit, work->aoerep);
+	aoestats_reply(work);
+
+	/* Retransmits of this request get a copy of the reply from now on */
+	aoetag_keep(work);
+	aoetag_del(work);
+
+	aoeskb_xmit(work);
 	aoereq_destroy(work);
 
 }
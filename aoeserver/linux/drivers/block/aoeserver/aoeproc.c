@@ -24,6 +24,8 @@
 #include <linux/seq_file.h>
 #include <linux/netdevice.h>
 #include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/pagemap.h>
 #include <asm/uaccess.h>
 
 #include "aoe.h"
@@ -32,10 +34,6 @@
 #define NARGSMAX 5     /* Maximum number of arguments we currently support */
 struct proc_dir_entry *procfile = NULL;
 
-/* imported from aoeblock.c */
-extern struct aoeblkdev *abd_head;
-extern rwlock_t abd_lock;
-
 /* Print out information about our devices when someone reads from 
  * /proc/aoeserver */
 static int aoeproc_seq_show(struct seq_file *s, void *p)
@@ -43,18 +41,15 @@ static int aoeproc_seq_show(struct seq_file *s, void *p)
 	struct accesslist *acl = NULL;
 	struct aoeblkdev *abd = NULL;
 	struct net_device *dev = NULL;
+	char cpus[64];
 
 	/* Header */
 	seq_printf(s, "#%s              %s     %s     %s\n",
 		   "<device>", "<shelf>", "<slot>", "<interface>");
 
-	/* If the linked list is empty, we have nothing more to give */
-	if (abd_head == NULL)
-		return (0);
-
-	read_lock(&abd_lock);
+	rcu_read_lock();
 	{
-		list_for_each_entry(abd, &abd_head->list, list) {
+		list_for_each_entry_rcu(abd, &abd_list, list) {
 			seq_printf(s, "%-25s %-10d %-10d", abd->name,
 				   abd->shelf, abd->slot);
 			if (abd->ifindex > 0)
@@ -69,7 +64,7 @@ static int aoeproc_seq_show(struct seq_file *s, void *p)
 		seq_printf(s, "#%s     %s       %s  \n",
 			   "<shelf>", "<slot>", "<allowed host>");
 
-		list_for_each_entry(abd, &abd_head->list, list)
+		list_for_each_entry_rcu(abd, &abd_list, list)
 		    if (abd->acl != NULL) {
 			read_lock(&abd->acl_lock);
 			list_for_each_entry(acl, &abd->acl->list, list) {
@@ -86,8 +81,122 @@ static int aoeproc_seq_show(struct seq_file *s, void *p)
 			}
 			read_unlock(&abd->acl_lock);
 		}
+
+		seq_printf(s, "\n# queues\n");
+		seq_printf(s, "#%s     %s       %s    %s   %s   %s   %s\n",
+			   "<shelf>", "<slot>", "<qdepth>", "<queued>",
+			   "<dropped>", "<nopool>", "<cpus>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list) {
+			if (cpus_empty(abd->cpus))
+				strcpy(cpus, "rx");
+			else
+				cpulist_scnprintf(cpus, sizeof(cpus), abd->cpus);
+
+			seq_printf(s, "%-14d %-14d %-11d %-10d %-12lu %-11lu %s\n",
+				   abd->shelf, abd->slot, abd->qdepth,
+				   aoecheckqueue(abd),
+				   aoestats_sum(abd->stats, AOESTAT_QFULL),
+				   aoestats_sum(abd->stats, AOESTAT_NOMEM), cpus);
+		}
+
+		seq_printf(s, "\n# errors\n");
+		seq_printf(s, "#%s     %s       %s     %s   %s\n",
+			   "<shelf>", "<slot>", "<range>", "<io>", "<short>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-12lu %-9lu %lu\n",
+			       abd->shelf, abd->slot,
+			       aoestats_sum(abd->stats, AOESTAT_RANGE),
+			       aoestats_sum(abd->stats, AOESTAT_IOERR),
+			       aoestats_sum(abd->stats, AOESTAT_SHORT));
+
+		seq_printf(s, "\n# write cache\n");
+		seq_printf(s, "#%s     %s       %s      %s   %s\n",
+			   "<shelf>", "<slot>", "<mode>", "<writes>",
+			   "<flushes>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-12s %-10lu %lu\n",
+			       abd->shelf, abd->slot,
+			       abd->wc.mode == AOE_WC_BACK ? "back" :
+			       abd->wc.mode == AOE_WC_THROUGH ? "through" : "off",
+			       aoestats_sum(abd->stats, AOESTAT_WCWRITE),
+			       aoestats_sum(abd->stats, AOESTAT_WCFLUSH));
+
+		seq_printf(s, "\n# read-ahead\n");
+		seq_printf(s, "#%s     %s       %s   %s   %s      %s\n",
+			   "<shelf>", "<slot>", "<kbytes>", "<streams>",
+			   "<hits>", "<misses>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-11lu %-11d %-10lu %lu\n",
+			       abd->shelf, abd->slot,
+			       abd->ra_pages * PAGE_CACHE_SIZE / 1024,
+			       aoestream_count(abd),
+			       aoestats_sum(abd->stats, AOESTAT_RAHIT),
+			       aoestats_sum(abd->stats, AOESTAT_RAMISS));
+
+		seq_printf(s, "\n# direct io\n");
+		seq_printf(s, "#%s     %s       %s      %s\n",
+			   "<shelf>", "<slot>", "<mode>", "<unaligned>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-12s %lu\n",
+			       abd->shelf, abd->slot,
+			       abd->direct ? "on" : "off",
+			       aoestats_sum(abd->stats, AOESTAT_UNALIGNED));
+
+		seq_printf(s, "\n# backend\n");
+		seq_printf(s, "#%s     %s       %s   %s       %s\n",
+			   "<shelf>", "<slot>", "<backend>", "<bios>",
+			   "<unplugs>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-11s %-12lu %lu\n",
+			       abd->shelf, abd->slot,
+			       abd->bdev ? "block" : "file",
+			       aoestats_sum(abd->stats, AOESTAT_BIO),
+			       aoestats_sum(abd->stats, AOESTAT_UNPLUG));
+
+		seq_printf(s, "\n# flush\n");
+		seq_printf(s, "#%s     %s       %s   %s   %s\n",
+			   "<shelf>", "<slot>", "<window>", "<requests>",
+			   "<flushes>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-11u %-11lu %lu\n",
+			       abd->shelf, abd->slot, abd->fl.window,
+			       aoestats_sum(abd->stats, AOESTAT_FLUSHREQ),
+			       aoestats_sum(abd->stats, AOESTAT_FLUSH));
+
+		seq_printf(s, "\n# async writes\n");
+		seq_printf(s, "#%s     %s       %s   %s   %s    %s\n",
+			   "<shelf>", "<slot>", "<kbytes>", "<queued>",
+			   "<writes>", "<full>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-11lu %-11lu %-11lu %lu\n",
+			       abd->shelf, abd->slot, abd->as.max / 1024,
+			       abd->as.bytes / 1024,
+			       aoestats_sum(abd->stats, AOESTAT_ASYNC),
+			       aoestats_sum(abd->stats, AOESTAT_ASYNCFULL));
+
+		seq_printf(s, "\n# retransmits\n");
+		seq_printf(s, "#%s     %s       %s   %s\n",
+			   "<shelf>", "<slot>", "<dropped>", "<replayed>");
+
+		list_for_each_entry_rcu(abd, &abd_list, list)
+		    seq_printf(s, "%-14d %-14d %-12lu %lu\n",
+			       abd->shelf, abd->slot,
+			       aoestats_sum(abd->stats, AOESTAT_DUPDROP),
+			       aoestats_sum(abd->stats, AOESTAT_DUPREPLAY));
 	}
-	read_unlock(&abd_lock);
+	rcu_read_unlock();
+
+	seq_printf(s, "\n# interfaces\n");
+	seq_printf(s, "#%s  %s\n", "<interface>", "<xmit>");
+	aoenet_seq_show(s);
 
 	return (0);
 }
@@ -167,6 +276,75 @@ int cmd_rmmask(int argc, char **argv)
 		return (-EINVAL);
 }
 
+/* Change a setting for an exported device */
+int cmd_set(int argc, char **argv)
+{
+	unsigned short slot;
+	unsigned short shelf;
+
+	if (argc < 5)
+		return (-EINVAL);
+
+	/* Convert slot and shelf */
+	shelf = simple_strtoul(argv[1], NULL, 0);
+	slot = simple_strtoul(argv[2], NULL, 0);
+
+	if (strcmp(argv[3], "qdepth") == 0)
+		return (aoeblock_setqdepth(shelf, slot,
+					   simple_strtoul(argv[4], NULL, 0)));
+
+	if (strcmp(argv[3], "cpus") == 0)
+		return (aoeblock_setcpus(shelf, slot, argv[4]));
+
+	if (strcmp(argv[3], "wcache") == 0)
+		return (aoeblock_setwcache(shelf, slot, argv[4]));
+
+	if (strcmp(argv[3], "readahead") == 0)
+		return (aoeblock_setreadahead(shelf, slot,
+					      simple_strtoul(argv[4], NULL, 0)));
+
+	if (strcmp(argv[3], "direct") == 0)
+		return (aoeblock_setdirect(shelf, slot, argv[4]));
+
+	if (strcmp(argv[3], "async") == 0)
+		return (aoeblock_setasync(shelf, slot,
+					  simple_strtoul(argv[4], NULL, 0)));
+
+	if (strcmp(argv[3], "flushwindow") == 0)
+		return (aoeblock_setflushwindow(shelf, slot,
+						simple_strtoul(argv[4], NULL, 0)));
+
+	return (-EINVAL);
+}
+
+/* Change a setting for a network interface */
+int cmd_ifset(int argc, char **argv)
+{
+	struct net_device *dev;
+	int ifindex;
+
+	if (argc < 4)
+		return (-EINVAL);
+
+	dev = dev_get_by_name(&init_net, argv[1]);
+	if (dev == NULL)
+		return (-EINVAL);
+
+	ifindex = dev->ifindex;
+
+	/* Subtle - get_dev_by_name() incremented the usage count */
+	dev_put(dev);
+
+	if (strcmp(argv[2], "xmit") == 0) {
+		if (strcmp(argv[3], "direct") == 0)
+			return (aoenet_setxmit(ifindex, 1));
+		if (strcmp(argv[3], "queue") == 0)
+			return (aoenet_setxmit(ifindex, 0));
+	}
+
+	return (-EINVAL);
+}
+
 /* Register a block device */
 int cmd_register(int argc, char **argv)
 {
@@ -292,6 +470,10 @@ int aoeproc_write(struct file *fp, const char *buffer, size_t count,
 		arg0 = CMDHOSTMASK;
 	else if (strncmp(argv[0], "rmmask", 6) == 0)
 		arg0 = CMDRMMASK;
+	else if (strncmp(argv[0], "set", 3) == 0)
+		arg0 = CMDSET;
+	else if (strncmp(argv[0], "ifset", 5) == 0)
+		arg0 = CMDIFSET;
 
 	if (arg0 == CMDEINVAL)
 		goto parse_error;
@@ -332,6 +514,16 @@ int aoeproc_write(struct file *fp, const char *buffer, size_t count,
 			goto parse_error;
 		break;
 
+	case CMDSET:
+		if (cmd_set(nargs, argv) != 0)
+			goto parse_error;
+		break;
+
+	case CMDIFSET:
+		if (cmd_ifset(nargs, argv) != 0)
+			goto parse_error;
+		break;
+
 	default:
 		printk(KERN_ERR "aoeproc.c: Unknown command\n");
 		goto parse_error;
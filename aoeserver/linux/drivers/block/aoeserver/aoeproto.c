@@ -0,0 +1,414 @@
+/*
+ *  linux/drivers/block/aoeserver/aoeproto.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file take care of the protocol side of handling
+ * a request: decoding and checking ata requests, filling in the headers
+ * of replies, matching and setting config strings and building the
+ * identify data. They work on plain buffers and never sleep, lock or
+ * allocate, so they can be called from any context. Nothing in here may
+ * depend on the kernel beyond what aoeproto.h pulls in, the same file is
+ * built into the userspace simulator in sim/.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#endif
+
+#include "aoeproto.h"
+
+/* The bucket of shelf.slot in the device hash. The top bits of the
+ * product with the 32 bit golden ratio prime, like hash_long() on a 32
+ * bit machine. */
+unsigned int aoeproto_hash(u16 shelf, u8 slot)
+{
+	u32 key = (u32)shelf << 8 | slot;
+
+	return ((key * 0x9e370001U) >> (32 - AOE_HASH_BITS));
+}
+
+/* Decode the sector address of an ata request */
+u64 aoeproto_lba(const struct aoe_atahdr *ata)
+{
+	u64 lba = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		lba |= (u64)ata->lba[i] << i * 8;
+
+	if (ata->flags & AOE_ATAFLAG_LBA48)
+		return (lba & 0x0000ffffffffffffULL);	/* full 48 */
+
+	return (lba & 0x0fffffff);
+}
+
+/* Tell reads from writes, returns AOEPROTO_READ, AOEPROTO_WRITE or zero
+ * for anything else */
+int aoeproto_rw(const struct aoe_atahdr *ata)
+{
+	switch (ata->cmdstat) {
+	case WIN_READ:
+	case WIN_READ_EXT:
+		return (AOEPROTO_READ);
+
+	case WIN_WRITE:
+	case WIN_WRITE_EXT:
+	case AOE_ATA_WRITE_FUA_EXT:
+	case AOE_ATA_WRITE_MULTI_FUA_EXT:
+		return (AOEPROTO_WRITE);
+	}
+
+	return (0);
+}
+
+/* Check if a write has to be stable before it is acknowledged */
+int aoeproto_fua(const struct aoe_atahdr *ata)
+{
+	return (ata->cmdstat == AOE_ATA_WRITE_FUA_EXT ||
+		ata->cmdstat == AOE_ATA_WRITE_MULTI_FUA_EXT);
+}
+
+/* Check that a read or write lies within a device of size sectors */
+int aoeproto_inrange(const struct aoe_atahdr *ata, u64 size)
+{
+	return (aoeproto_lba(ata) + ata->nsect <= size);
+}
+
+/* Return the number of sectors that fit in one frame on an interface.
+ * The mtu doesnt include the ethernet header, but the rest of the
+ * aoe-header and the ata-header has to fit. 1500 gives us 2 sectors,
+ * 9000 gives 17. */
+int aoeproto_maxsect(unsigned int mtu)
+{
+	int n;
+
+	n = mtu - (sizeof(struct aoe_hdr) - ETH_HLEN) -
+	    sizeof(struct aoe_atahdr);
+	n /= 512;
+
+	if (n > AOE_MAXSECT)
+		n = AOE_MAXSECT;
+	if (n < 1)
+		n = 1;
+
+	return (n);
+}
+
+/* Figure out how large the reply to a request is going to be, aoe-header
+ * included, when read data is carried in the reply itself */
+unsigned int aoeproto_replen(const struct aoe_hdr *req, int maxsect, u64 size)
+{
+	const struct aoe_atahdr *ata;
+	unsigned int len = sizeof(struct aoe_hdr);
+
+	switch (req->cmd) {
+	case AOE_CMD_ATA:
+		ata = (const struct aoe_atahdr *)(req + 1);
+		len += sizeof(struct aoe_atahdr);
+
+		switch (ata->cmdstat) {
+		case WIN_READ:
+		case WIN_READ_EXT:
+			/* Oversized requests and requests beyond the end
+			 * are answered with an error */
+			if (ata->nsect <= maxsect && aoeproto_inrange(ata, size))
+				len += ata->nsect * 512;
+			break;
+
+		case WIN_IDENTIFY:
+			len += 512;
+			break;
+		}
+		break;
+
+	case AOE_CMD_CFG:
+		len += sizeof(struct aoe_cfghdr) + 1024;
+		break;
+	}
+
+	return (len);
+}
+
+/* Fill in the aoe-header of a reply. The header is copied from the
+ * request, the reply goes back to the source of the request from addr,
+ * the address of the interface it came in on. */
+void aoeproto_rephdr(struct aoe_hdr *rep, const struct aoe_hdr *req,
+		     const unsigned char *addr, u16 shelf, u8 slot)
+{
+	memcpy(rep, req, sizeof(struct aoe_hdr));
+	memcpy(rep->eth.h_dest, req->eth.h_source, ETH_ALEN);
+	memcpy(rep->eth.h_source, addr, ETH_ALEN);
+
+	rep->ver_flags |= AOE_FLAG_RSP;	/* response flag */
+
+	/* Set the appropriate major and minor number */
+	rep->shelf = cpu_to_be16(shelf);
+	rep->slot = slot;
+}
+
+/* Start the ata-header of a reply from the request and sanity check the
+ * request. Returns what the request asks for, or AOEPROTO_ERROR or
+ * AOEPROTO_RANGE with the error already filled in the reply. */
+int aoeproto_atacheck(const struct aoe_atahdr *req, struct aoe_atahdr *rep,
+		      int maxsect, u64 size)
+{
+	/* Copy the ata-header from the request to the reply */
+	memcpy(rep, req, sizeof(struct aoe_atahdr));
+
+	/* So far, everything is ok */
+	rep->err_feature = 0;
+	rep->cmdstat = READY_STAT;
+
+	/* Santity check the sector count, it has to fit in one frame */
+	if (req->nsect > maxsect)
+		goto error;
+
+	switch (req->cmdstat) {
+	case WIN_READ:
+	case WIN_READ_EXT:
+	case WIN_WRITE:
+	case WIN_WRITE_EXT:
+	case AOE_ATA_WRITE_FUA_EXT:
+	case AOE_ATA_WRITE_MULTI_FUA_EXT:
+		/* Requests beyond the end are answered right away */
+		if (!aoeproto_inrange(req, size)) {
+			rep->err_feature = IDNF_ERR;
+			rep->cmdstat = ERR_STAT | READY_STAT;
+			return (AOEPROTO_RANGE);
+		}
+
+		return (aoeproto_rw(req));
+
+	case WIN_IDENTIFY:
+		return (AOEPROTO_IDENTIFY);
+
+	case WIN_FLUSH_CACHE:
+	case WIN_FLUSH_CACHE_EXT:
+		return (AOEPROTO_FLUSH);
+	}
+
+	/* We didnt understand the command :( */
+
+      error:
+	rep->err_feature = ABRT_ERR;
+	rep->cmdstat = ERR_STAT | READY_STAT;
+	return (AOEPROTO_ERROR);
+}
+
+/* Set the ata status of a reply from the outcome of a transfer. ret is
+ * the number of bytes transfered or a negative error, len the number of
+ * bytes asked for. Returns zero if all went well, 1 for a short transfer
+ * and -1 for an error. */
+int aoeproto_status(struct aoe_atahdr *rep, int write, long ret,
+		    unsigned int len)
+{
+	if (ret >= 0 && (unsigned long)ret == len)
+		return (0);
+
+	rep->cmdstat = ERR_STAT | READY_STAT;
+
+	if (ret >= 0) {
+		/* Short transfer, we ran into the end of the file */
+		rep->err_feature = IDNF_ERR;
+		return (1);
+	}
+
+	switch (ret) {
+	case -EIO:
+	case -ENODATA:
+		/* The medium let us down */
+		if (write) {
+			rep->cmdstat |= WRERR_STAT;
+			rep->err_feature = ABRT_ERR;
+		} else
+			rep->err_feature = ECC_ERR;
+		break;
+
+	case -ENOSPC:
+	case -EFBIG:
+	case -ENXIO:
+		rep->err_feature = IDNF_ERR;
+		break;
+
+	default:
+		rep->err_feature = ABRT_ERR;
+		break;
+	}
+
+	return (-1);
+}
+
+/* Identify data is a table of little endian 16 bit words */
+static void aoeproto_idword(u8 *id, int word, u16 val)
+{
+	id[word * 2] = val & 0xff;
+	id[word * 2 + 1] = val >> 8;
+}
+
+/* Build the 512 bytes of identify data of a device of size sectors,
+ * wcache is set if writes may be acknowledged before they are written.
+ * The words are the ones of struct hd_driveid in linux/hdreg.h. */
+void aoeproto_buildid(u8 *id, u64 size, const char *serial, int wcache)
+{
+	u32 lba28 = size > MAXATALBA ? MAXATALBA : size;
+	int i;
+
+	/* zero out everything */
+	memset(id, 0, 512);
+
+	strcpy((char *)id + 54, "123456789");	/* model, word 27 */
+	strncpy((char *)id + 20, serial, 19);	/* serial_no, word 10 */
+
+	/* Set up plain old CHS, its obsolete, but the aoe-client for
+	 * Linux sometimes uses it, so we fill out the fields anyway.
+	 * This wont be all that accurate, but i thinks it will work */
+	aoeproto_idword(id, 54, (size >> 8) >> 6);	/* cur_cyls */
+	aoeproto_idword(id, 55, 255);	/* cur_heads */
+	aoeproto_idword(id, 56, 64);	/* cur_sectors */
+
+	/* We support LBA */
+	aoeproto_idword(id, 49, 1 << 9);	/* capability */
+	aoeproto_idword(id, 60, lba28 & 0xffff);	/* lba_capacity */
+	aoeproto_idword(id, 61, lba28 >> 16);
+
+	/* We support LBA 48 and flush cache (ext) */
+	aoeproto_idword(id, 83, 1 << 10 | 1 << 12 | 1 << 13);	/* command_set_2 */
+	aoeproto_idword(id, 86, 1 << 10 | 1 << 12 | 1 << 13);	/* cfs_enable_2 */
+
+	/* and the fua writes, bit 14 says the word is valid */
+	aoeproto_idword(id, 84, 1 << 14 | 1 << 6);	/* cfsse */
+	aoeproto_idword(id, 87, 1 << 14 | 1 << 6);	/* csf_default */
+
+	/* Tell the initiator to flush if we have a write-back cache */
+	if (wcache) {
+		aoeproto_idword(id, 82, 1 << 5);	/* command_set_1 */
+		aoeproto_idword(id, 85, 1 << 5);	/* cfs_enable_1 */
+	}
+	for (i = 0; i < 4; i++)	/* lba_capacity_2 */
+		aoeproto_idword(id, 100 + i, size >> (i * 16));
+}
+
+/* Copy prepared identify data to a reply, with the number of sectors we
+ * accept in one request on the interface the reply goes out on */
+void aoeproto_idreply(u8 *dst, const u8 *id, int maxsect)
+{
+	memcpy(dst, id, 512);
+	dst[94] = maxsect;	/* max_multsect, low byte of word 47 */
+}
+
+/* Fill in the config reply template from the length of the config
+ * string and the queue depth. The scnt and cmd fields depend on the
+ * request and are patched in by aoeproto_cfgreply(). */
+void aoeproto_buildcfg(struct aoe_cfgtmpl *cfg, u16 cfg_len, int qdepth)
+{
+	cfg->hdr.queuelen = cpu_to_be16(qdepth);
+	cfg->hdr.firmware = cpu_to_be16(0x4000);
+	cfg->hdr.scnt = 0;
+	cfg->hdr.aoever_cmd = 0x10;	/* AOE Version one */
+	cfg->hdr.data_len = cpu_to_be16(cfg_len);
+}
+
+/* Match a config string against the one in a query, returns non-zero
+ * if a device with config string data should answer */
+int aoeproto_cfgmatch(int ccmd, const u8 *data, unsigned int len,
+		      const u8 *req, unsigned int reqlen)
+{
+	switch (ccmd) {
+	case 1:		/* respond to exact match */
+		return (reqlen == len && memcmp(data, req, reqlen) == 0);
+
+	case 2:		/* respond on partial match */
+		return (reqlen <= len && memcmp(data, req, reqlen) == 0);
+	}
+
+	return (1);
+}
+
+/* Carry out a config request against the template of a device, avail is
+ * the number of bytes of config string present in the request. Errors
+ * are flagged in the aoe-header of the reply. Returns AOEPROTO_NOREPLY
+ * if we should keep quiet, AOEPROTO_CHANGED if the config string was set
+ * and AOEPROTO_REPLY otherwise. */
+int aoeproto_cfg(struct aoe_cfgtmpl *cfg, u16 *cfg_len, struct aoe_hdr *rep,
+		 const struct aoe_cfghdr *req, unsigned int avail)
+{
+	const u8 *data = (const u8 *)(req + 1);
+	unsigned int reqlen = be16_to_cpu(req->data_len);
+	int ccmd = req->aoever_cmd & 0x0f;
+
+	if (reqlen > avail) {
+		rep->ver_flags |= AOE_FLAG_ERR;
+		rep->error = AOE_ERR_BADARG;
+		return (AOEPROTO_REPLY);
+	}
+
+	switch (ccmd) {
+	case 0:		/* read */
+		return (AOEPROTO_REPLY);
+
+	case 1:		/* respond to exact match */
+	case 2:		/* respond on partial match */
+		if (!aoeproto_cfgmatch(ccmd, cfg->data, *cfg_len, data, reqlen))
+			return (AOEPROTO_NOREPLY);
+		return (AOEPROTO_REPLY);
+
+	case 3:		/* Set config string if empty */
+		if (*cfg_len != 0) {
+			rep->ver_flags |= AOE_FLAG_ERR;
+			rep->error = AOE_ERR_CFG_SET;
+			return (AOEPROTO_REPLY);
+		}
+
+		/* Fall through */
+
+	case 4:		/* Set config string */
+		if (reqlen > sizeof(cfg->data)) {
+			rep->ver_flags |= AOE_FLAG_ERR;
+			rep->error = AOE_ERR_BADARG;
+			return (AOEPROTO_REPLY);
+		}
+
+		memcpy(cfg->data, data, reqlen);
+		*cfg_len = reqlen;
+		cfg->hdr.data_len = cpu_to_be16(reqlen);
+		return (AOEPROTO_CHANGED);
+	}
+
+	rep->ver_flags |= AOE_FLAG_ERR;
+	rep->error = AOE_ERR_BADCMD;
+	return (AOEPROTO_REPLY);
+}
+
+/* Copy the config header and string from the template to a reply and
+ * patch in the fields that depend on the request. Returns the number of
+ * bytes copied. */
+unsigned int aoeproto_cfgreply(struct aoe_cfghdr *dst,
+			       const struct aoe_cfgtmpl *cfg, u16 cfg_len,
+			       int ccmd, int maxsect)
+{
+	unsigned int len = sizeof(struct aoe_cfghdr) + cfg_len;
+
+	memcpy(dst, cfg, len);
+
+	/* Tell the client how large requests it can send us */
+	dst->scnt = maxsect;
+
+	/* Copy cmd in reply */
+	dst->aoever_cmd = 0x10 | ccmd;	/* AOE Version one */
+
+	return (len);
+}
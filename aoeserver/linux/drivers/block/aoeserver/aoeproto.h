@@ -0,0 +1,146 @@
+/*
+ *  linux/drivers/block/aoeserver/aoeproto.h
+ *
+ * ATA Over Ethernet storage target for Linux.
+ */
+
+ /* 
+  * This program is free software; you can redistribute it and/or
+  * modify it under the terms of the GNU General Public License
+  * as published by the Free Software Foundation; either version 2
+  * of the License, or (at your option) any later version.
+  *
+  *  Copyright (C) 2005  wowie@pi.nxs.se
+  */
+
+ /* 
+  * Definitions for the ATA over Ethernet protocol, and the parts of the
+  * request handling that dont depend on the kernel, see aoeproto.c. This
+  * file is also used by the userspace simulator in sim/, which provides
+  * the few kernel definitions needed in aoeshim.h.
+  */
+
+#ifndef AOEPROTO_H
+#define AOEPROTO_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/if_ether.h>	/* eth-struct used in aoe-header */
+#include <linux/hdreg.h>	/* ata commands and status bits */
+#include <asm/byteorder.h>
+#else
+#include "aoeshim.h"
+#endif
+
+#define PRIV_ETH_P_AOE 0x88A2
+
+/* Bit field in ver_flags of aoe-header */
+#define AOE_FLAG_RSP (1<<3)
+#define AOE_FLAG_ERR (1<<2)
+
+/* Error codes for the error field in the aoe header */
+#define AOE_ERR_BADCMD       1	/* Unrecognized command code */
+#define AOE_ERR_BADARG       2	/* Bad argument parameter */
+#define AOE_ERR_DEVUNAVAIL   3	/* Device unavailable */
+#define AOE_ERR_CFG_SET      4	/* Config string present */
+#define AOE_ERR_UNSUPVER     5	/* Unsupported version */
+
+/* Commands in cmd-field of aoe-header */
+#define AOE_CMD_ATA 0
+#define AOE_CMD_CFG 1
+
+struct aoe_hdr {
+	struct ethhdr eth;   /* ethernet header, see linux/if_ether.h */
+	u8 ver_flags;	     /* bit field: 7-4 ver, 3 rsp, 2 error, 0&1 zero */
+	u8 error;	     /* If error bit is set, fill out this field */
+	u16 shelf;
+	u8 slot;
+	u8 cmd;		     /* ATA or CFG */
+	u32 tag;	     /* Uniqueue request tag */
+} __attribute__ ((packed));
+
+#define MAXATALBA (int)(0x0fffffff)
+
+/* Upper bound on sectors per frame, nsect is a single byte */
+#define AOE_MAXSECT 255
+
+/* Bitfields for the flags field in the aoe ata header */
+#define AOE_ATAFLAG_LBA48 (1 << 6)
+#define AOE_ATAFLAG_ASYNC (1 << 1)
+#define AOE_ATAFLAG_WRITE (1 << 0)
+
+struct aoe_atahdr {
+	u8 flags;		/* bitfield: 7 zero, 6 LBA48, 5 zero
+				 * 4 Device/head, 3 zero, 2 zero, 
+				 * 1 Async IO, 0 Read/Write */
+	u8 err_feature;		/* Check linux/hdreg.h for status codes */
+	u8 nsect;		/* Number of sectors to transfer */
+	u8 cmdstat;		/* cmd in request and status in reply */
+	u8 lba[6];		/* 48bit LBA addressing */
+	u8 notused[2];		/* reserved */
+} __attribute__ ((packed));
+
+struct aoe_cfghdr {
+	u16 queuelen;		/* The number of requests we can queue */
+	u16 firmware;		/* Firmware version */
+	u8 scnt;		/* Max sectors per ata-request */
+	u8 aoever_cmd;		/* bit field: 7-4 aoe-version, 3 - 0 cmd */
+	u16 data_len;		/* data length */
+} __attribute__ ((packed));
+
+/* A config reply without the aoe-header, kept ready to send */
+struct aoe_cfgtmpl {
+	struct aoe_cfghdr hdr;
+	u8 data[1024];		/* Config string */
+} __attribute__ ((packed));
+
+/* Writes with forced unit access, the data has to be stable before the
+ * write is acknowledged. Not in hdreg.h. */
+#define AOE_ATA_WRITE_FUA_EXT		0x3d	/* Write dma fua ext */
+#define AOE_ATA_WRITE_MULTI_FUA_EXT	0xce	/* Write multiple fua ext */
+
+/* What an ata request asks for, see aoeproto_atacheck() */
+#define AOEPROTO_RANGE		-2	/* Beyond the end of the device */
+#define AOEPROTO_ERROR		-1	/* Anything else we cant do */
+#define AOEPROTO_READ		1
+#define AOEPROTO_WRITE		2
+#define AOEPROTO_IDENTIFY	3
+#define AOEPROTO_FLUSH		4
+
+/* Size of the shelf/slot hash used by find_aoedevice(), see
+ * aoeproto_hash() */
+#define AOE_HASH_BITS 8
+#define AOE_HASH_SIZE (1 << AOE_HASH_BITS)
+
+/* Return values of aoeproto_cfg() */
+#define AOEPROTO_NOREPLY	-1	/* The request doesnt match */
+#define AOEPROTO_REPLY		0
+#define AOEPROTO_CHANGED	1	/* The config string was set */
+
+/* aoeproto.c */
+unsigned int aoeproto_hash(u16 shelf, u8 slot);
+u64 aoeproto_lba(const struct aoe_atahdr *ata);
+int aoeproto_rw(const struct aoe_atahdr *ata);
+int aoeproto_fua(const struct aoe_atahdr *ata);
+int aoeproto_inrange(const struct aoe_atahdr *ata, u64 size);
+int aoeproto_maxsect(unsigned int mtu);
+unsigned int aoeproto_replen(const struct aoe_hdr *req, int maxsect, u64 size);
+void aoeproto_rephdr(struct aoe_hdr *rep, const struct aoe_hdr *req,
+		     const unsigned char *addr, u16 shelf, u8 slot);
+int aoeproto_atacheck(const struct aoe_atahdr *req, struct aoe_atahdr *rep,
+		      int maxsect, u64 size);
+int aoeproto_status(struct aoe_atahdr *rep, int write, long ret,
+		    unsigned int len);
+void aoeproto_buildid(u8 *id, u64 size, const char *serial, int wcache);
+void aoeproto_idreply(u8 *dst, const u8 *id, int maxsect);
+void aoeproto_buildcfg(struct aoe_cfgtmpl *cfg, u16 cfg_len, int qdepth);
+int aoeproto_cfgmatch(int ccmd, const u8 *data, unsigned int len,
+		      const u8 *req, unsigned int reqlen);
+int aoeproto_cfg(struct aoe_cfgtmpl *cfg, u16 *cfg_len, struct aoe_hdr *rep,
+		 const struct aoe_cfghdr *req, unsigned int reqlen);
+unsigned int aoeproto_cfgreply(struct aoe_cfghdr *dst,
+			       const struct aoe_cfgtmpl *cfg, u16 cfg_len,
+			       int ccmd, int maxsect);
+/* end aoeproto.c */
+
+#endif /* AOEPROTO_H */
@@ -0,0 +1,275 @@
+/*
+ *  linux/drivers/block/aoeserver/aoeskb.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file allocates and recycles the skb:s used for
+ * replies. Every reply skb is kept in a pool keyed on the outgoing
+ * interface and the buffer size. Like pktgen we hold an extra reference
+ * on the skb when we send it, once the driver has dropped its reference
+ * the skb is ours again and can be reused for the next reply without
+ * going through the allocator.
+ *
+ * The sent skbs are kept in a ring of pointers rather than on an skb
+ * list, the stack uses skb->next and skb->prev for its own queues while
+ * it owns the skb.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+#include "aoe.h"
+
+/* Reply sizes are rounded up to this, it keeps the number of pools down
+ * and leaves room for drivers padding small frames to ETH_ZLEN. */
+#define AOESKB_ALIGN   512
+
+/* Max number of skbs kept per pool */
+#define AOESKB_POOLMAX 128
+
+/* Reuse incoming request skbs for replies that fit in them */
+static int aoe_inplace = 0;
+module_param_named(inplace, aoe_inplace, int, 0644);
+MODULE_PARM_DESC(inplace, "Send short replies in the request skb (default 0)");
+
+struct aoeskbpool {
+	struct list_head list;
+	int ifindex;
+	unsigned int size;		/* skb_end_pointer() - head */
+	spinlock_t lock;
+	unsigned int first;		/* Oldest skb in ring */
+	unsigned int count;
+	struct sk_buff *ring[AOESKB_POOLMAX];
+};
+
+static LIST_HEAD(aoeskb_pools);
+static DEFINE_SPINLOCK(aoeskb_lock);
+
+/* Find the pool for this interface and buffer size, or create it */
+static struct aoeskbpool *aoeskb_pool(int ifindex, unsigned int size)
+{
+	struct aoeskbpool *pool;
+
+	spin_lock_bh(&aoeskb_lock);
+	list_for_each_entry(pool, &aoeskb_pools, list)
+	    if (pool->ifindex == ifindex && pool->size == size)
+		goto out;
+
+	pool = kmalloc(sizeof(*pool), GFP_ATOMIC);
+	if (pool) {
+		pool->ifindex = ifindex;
+		pool->size = size;
+		spin_lock_init(&pool->lock);
+		pool->first = 0;
+		pool->count = 0;
+		list_add(&pool->list, &aoeskb_pools);
+	}
+
+      out:
+	spin_unlock_bh(&aoeskb_lock);
+	return (pool);
+}
+
+/* Add an skb to the pool, at the old end if it is idle so that
+ * aoeskb_alloc() finds it first. Returns -1 if the pool is full. */
+static int aoeskb_put(struct aoeskbpool *pool, struct sk_buff *skb, int idle)
+{
+	int ret = -1;
+
+	spin_lock_bh(&pool->lock);
+	if (pool->count < AOESKB_POOLMAX) {
+		if (idle) {
+			pool->first = (pool->first + AOESKB_POOLMAX - 1) %
+			    AOESKB_POOLMAX;
+			pool->ring[pool->first] = skb;
+		} else
+			pool->ring[(pool->first + pool->count) %
+				   AOESKB_POOLMAX] = skb;
+		pool->count++;
+		ret = 0;
+	}
+	spin_unlock_bh(&pool->lock);
+
+	return (ret);
+}
+
+/* An skb can be reused once nobody but us holds a reference to it, and
+ * nothing has been attached to it on the way out */
+static int aoeskb_idle(struct sk_buff *skb)
+{
+	return (!skb_shared(skb) && !skb_cloned(skb) &&
+		skb_shinfo(skb)->nr_frags == 0 &&
+		skb_shinfo(skb)->frag_list == NULL &&
+		skb->destructor == NULL && skb->dst == NULL && skb->sk == NULL);
+}
+
+/* Make an idle skb look like it came straight from alloc_skb() */
+static void aoeskb_reset(struct sk_buff *skb)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+	memset(skb, 0, offsetof(struct sk_buff, tail));
+	skb->data = skb->head;
+	skb_reset_tail_pointer(skb);
+
+	shinfo->gso_size = 0;
+	shinfo->gso_segs = 0;
+	shinfo->gso_type = 0;
+}
+
+/* Allocate an skb with room for len bytes of reply and the link layer
+ * headroom the outgoing device asks for. This is called from kaoed and
+ * may sleep. */
+struct sk_buff *aoeskb_alloc(struct net_device *dev, unsigned int len)
+{
+	struct aoeskbpool *pool;
+	struct sk_buff *skb = NULL;
+	unsigned int headroom = LL_RESERVED_SPACE(dev);
+	unsigned int size;
+
+	size = SKB_DATA_ALIGN(ALIGN(len, AOESKB_ALIGN) + headroom);
+
+	pool = aoeskb_pool(dev->ifindex, size);
+	if (pool) {
+		/* Replies complete more or less in order, so if the oldest
+		 * one is still owned by the driver, the rest are as well */
+		spin_lock_bh(&pool->lock);
+		if (pool->count && aoeskb_idle(pool->ring[pool->first])) {
+			skb = pool->ring[pool->first];
+			pool->first = (pool->first + 1) % AOESKB_POOLMAX;
+			pool->count--;
+		}
+		spin_unlock_bh(&pool->lock);
+	}
+
+	if (skb)
+		aoeskb_reset(skb);
+	else {
+		skb = alloc_skb(size, GFP_KERNEL);
+		if (skb == NULL)
+			return (NULL);
+	}
+
+	skb_reserve(skb, headroom);
+
+	return (skb);
+}
+
+/* Give an unsent skb back to its pool */
+void aoeskb_recycle(struct sk_buff *skb)
+{
+	struct aoeskbpool *pool;
+
+	pool = aoeskb_pool(skb->dev->ifindex, skb_end_pointer(skb) - skb->head);
+	if (pool == NULL || !aoeskb_idle(skb) || aoeskb_put(pool, skb, 1))
+		kfree_skb(skb);
+}
+
+/* Send an skb, batched with the other replies of this kaoed pass if
+ * we are running in a kaoed thread */
+static void aoeskb_send(struct sk_buff *skb)
+{
+	if (aoewq_xmit(skb) != 0)
+		dev_queue_xmit(skb);
+}
+
+/* Send the reply in the request skb if there is room for it. The reply
+ * skb is then never sent and goes straight back to the pool. Returns
+ * the skb to transmit. */
+static struct sk_buff *aoeskb_inplace(struct aoerequest *work)
+{
+	struct sk_buff *req = work->skb_req;
+	struct sk_buff *rep = work->skb_rep;
+
+	if (!aoe_inplace || req == NULL)
+		return (rep);
+
+	/* Broadcasts share the request skb between all devices */
+	if (skb_shared(req) || skb_cloned(req))
+		return (rep);
+
+	if (skb_mac_header(req) + rep->len > skb_tail_pointer(req))
+		return (rep);
+
+	/* Rewind to the ethernet header and overwrite the request */
+	skb_push(req, req->data - skb_mac_header(req));
+	memcpy(req->data, rep->data, rep->len);
+	if (pskb_trim(req, rep->len) != 0)
+		return (rep);
+
+	skb_reset_network_header(req);
+	req->dev = rep->dev;
+	req->protocol = rep->protocol;
+	req->priority = 0;
+	req->ip_summed = CHECKSUM_NONE;
+
+	work->skb_req = NULL;
+	work->skb_rep = NULL;
+	aoeskb_recycle(rep);
+
+	return (req);
+}
+
+/* Transmit the reply of a request. If the reply came from aoeskb_alloc()
+ * we keep a reference to it so that it can be recycled. */
+void aoeskb_xmit(struct aoerequest *work)
+{
+	struct aoeskbpool *pool;
+	struct sk_buff *skb;
+
+	skb = aoeskb_inplace(work);
+	if (skb != work->skb_rep) {
+		aoeskb_send(skb);
+		return;
+	}
+	work->skb_rep = NULL;
+
+	/* Replies carrying page fragments are left to the driver to free,
+	 * they would block the pool until the pages are released */
+	if (skb_is_nonlinear(skb)) {
+		aoeskb_send(skb);
+		return;
+	}
+
+	pool = aoeskb_pool(skb->dev->ifindex, skb_end_pointer(skb) - skb->head);
+	if (pool) {
+		skb_get(skb);
+		if (aoeskb_put(pool, skb, 0))
+			kfree_skb(skb);
+	}
+
+	aoeskb_send(skb);
+}
+
+/* Release all pooled skbs, drivers may still hold references to some of
+ * them, they are freed when the driver lets go of them. */
+void aoeskb_exit(void)
+{
+	struct aoeskbpool *pool, *n;
+
+	spin_lock_bh(&aoeskb_lock);
+	list_for_each_entry_safe(pool, n, &aoeskb_pools, list) {
+		list_del(&pool->list);
+		while (pool->count--) {
+			kfree_skb(pool->ring[pool->first]);
+			pool->first = (pool->first + 1) % AOESKB_POOLMAX;
+		}
+		kfree(pool);
+	}
+	spin_unlock_bh(&aoeskb_lock);
+}
@@ -0,0 +1,278 @@
+/*
+ *  linux/drivers/block/aoeserver/aoestats.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file keep the traffic counters and latency
+ * histograms of every exported device and every interface, and export
+ * them in debugfs as aoeserver/stats. Each cpu has its own copy of the
+ * counters, so they can be updated from the network softirq and from the
+ * kaoed threads without any shared cache lines. The copies are summed
+ * when the stats file is read.
+ *
+ * The stats file has one "key=value" line per counter, keys look like
+ * target.<shelf>.<slot>.<counter> and if.<interface>.<counter>. The
+ * histograms are cumulative, like prometheus wants them. The format will
+ * only ever be added to.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/rcupdate.h>
+#include <asm/local.h>
+
+#include "aoe.h"
+
+static struct dentry *aoestats_dir;
+static struct dentry *aoestats_file;
+
+static const char *aoestats_names[AOESTAT_MAX] = {
+	[AOESTAT_RX] = "rx_frames",
+	[AOESTAT_DROP] = "dropped",
+	[AOESTAT_TX] = "tx_replies",
+	[AOESTAT_READ] = "read_bytes",
+	[AOESTAT_WRITE] = "write_bytes",
+	[AOESTAT_QFULL] = "queue_full",
+	[AOESTAT_NOMEM] = "alloc_fail",
+	[AOESTAT_ACL] = "acl_reject",
+	[AOESTAT_RANGE] = "range_err",
+	[AOESTAT_IOERR] = "io_err",
+	[AOESTAT_SHORT] = "short_err",
+	[AOESTAT_WCWRITE] = "wcache_writes",
+	[AOESTAT_WCFLUSH] = "wcache_flushes",
+	[AOESTAT_RAHIT] = "readahead_hits",
+	[AOESTAT_RAMISS] = "readahead_misses",
+	[AOESTAT_DUPDROP] = "dup_dropped",
+	[AOESTAT_DUPREPLAY] = "dup_replayed",
+	[AOESTAT_UNALIGNED] = "direct_unaligned",
+	[AOESTAT_BIO] = "bios",
+	[AOESTAT_UNPLUG] = "unplugs",
+	[AOESTAT_FLUSHREQ] = "flush_requests",
+	[AOESTAT_FLUSH] = "flushes",
+	[AOESTAT_ASYNC] = "async_writes",
+	[AOESTAT_ASYNCFULL] = "async_full",
+};
+
+static const char *aoestats_histnames[AOEHIST_MAX] = {
+	[AOEHIST_QUEUE] = "lat_queue_us",
+	[AOEHIST_IO] = "lat_io_us",
+	[AOEHIST_TOTAL] = "lat_total_us",
+	[AOEHIST_FLUSH] = "lat_flush_us",
+	[AOEHIST_DRAIN] = "lat_drain_us",
+};
+
+/* Allocate a set of counters for each possible cpu, in cpu local memory.
+ * This may sleep, interfaces get theirs from aoenet.c in process context
+ * after the first frame. */
+struct aoestats *aoestats_alloc(void)
+{
+	return (alloc_percpu(struct aoestats));
+}
+
+void aoestats_free(struct aoestats *st)
+{
+	if (st)
+		free_percpu(st);
+}
+
+/* Add to a counter of this cpu, st may be NULL */
+void aoestats_add(struct aoestats *st, int what, long n)
+{
+	if (st == NULL)
+		return;
+
+	local_add(n, &per_cpu_ptr(st, get_cpu())->count[what]);
+	put_cpu();
+}
+
+/* Count an event for both the device and the interface of a request */
+void aoestats_inc(struct aoerequest *work, int what)
+{
+	aoestats_add(work->abd->stats, what, 1);
+	if (work->aif)
+		aoestats_add(work->aif->stats, what, 1);
+}
+
+/* Add the time between start and end to a histogram */
+void aoestats_hist(struct aoestats *st, int which, ktime_t start, ktime_t end)
+{
+	unsigned long us;
+	int n;
+
+	if (st == NULL)
+		return;
+
+	us = ktime_to_us(ktime_sub(end, start));
+	n = us ? fls(us - 1) : 0;
+	if (n >= AOE_HISTBUCKETS)
+		n = AOE_HISTBUCKETS - 1;
+
+	st = per_cpu_ptr(st, get_cpu());
+	local_inc(&st->hist[which][n]);
+	local_add(us, &st->histsum[which]);
+	put_cpu();
+}
+
+/* Account for a reply that is about to be sent, called from aoexmit() */
+void aoestats_reply(struct aoerequest *work)
+{
+	struct aoestats *st[2] = { work->abd->stats,
+		work->aif ? work->aif->stats : NULL };
+	ktime_t now = ktime_get();
+	int what = -1;
+	int i;
+
+	/* Count the data of reads and writes that went well */
+	if (work->aoereq->cmd == AOE_CMD_ATA && work->atareply &&
+	    !(work->atareply->cmdstat & ERR_STAT)) {
+		switch (aoeproto_rw(work->atarequest)) {
+		case AOEPROTO_READ:
+			what = AOESTAT_READ;
+			break;
+		case AOEPROTO_WRITE:
+			what = AOESTAT_WRITE;
+			break;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (st[i] == NULL)
+			continue;
+
+		aoestats_add(st[i], AOESTAT_TX, 1);
+		if (what >= 0)
+			aoestats_add(st[i], what,
+				     work->atarequest->nsect * 512);
+		if (work->t_io.tv64)
+			aoestats_hist(st[i], AOEHIST_IO, work->t_io, now);
+		aoestats_hist(st[i], AOEHIST_TOTAL, work->t_rx, now);
+	}
+}
+
+/* Sum up a counter over all cpus */
+unsigned long aoestats_sum(struct aoestats *st, int what)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	    sum += local_read(&per_cpu_ptr(st, cpu)->count[what]);
+
+	return (sum);
+}
+
+/* Print one set of counters in the stats file */
+void aoestats_show(struct seq_file *s, const char *prefix,
+		   struct aoestats *st)
+{
+	unsigned long hist[AOE_HISTBUCKETS], sum, count;
+	struct aoestats *c;
+	int cpu, i, n;
+
+	if (st == NULL)
+		return;
+
+	for (i = 0; i < AOESTAT_MAX; i++)
+		seq_printf(s, "%s.%s=%lu\n", prefix, aoestats_names[i],
+			   aoestats_sum(st, i));
+
+	for (i = 0; i < AOEHIST_MAX; i++) {
+		memset(hist, 0, sizeof(hist));
+		sum = 0;
+		for_each_possible_cpu(cpu) {
+			c = per_cpu_ptr(st, cpu);
+			for (n = 0; n < AOE_HISTBUCKETS; n++)
+				hist[n] += local_read(&c->hist[i][n]);
+			sum += local_read(&c->histsum[i]);
+		}
+
+		count = 0;
+		for (n = 0; n < AOE_HISTBUCKETS - 1; n++) {
+			count += hist[n];
+			seq_printf(s, "%s.%s.le_%lu=%lu\n", prefix,
+				   aoestats_histnames[i], 1UL << n, count);
+		}
+		count += hist[n];
+		seq_printf(s, "%s.%s.le_inf=%lu\n", prefix,
+			   aoestats_histnames[i], count);
+		seq_printf(s, "%s.%s.count=%lu\n", prefix,
+			   aoestats_histnames[i], count);
+		seq_printf(s, "%s.%s.sum=%lu\n", prefix,
+			   aoestats_histnames[i], sum);
+	}
+}
+
+static int aoestats_seq_show(struct seq_file *s, void *p)
+{
+	struct aoeblkdev *abd;
+	char prefix[32];
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(abd, &abd_list, list) {
+		snprintf(prefix, sizeof(prefix), "target.%d.%d",
+			 abd->shelf, abd->slot);
+		aoestats_show(s, prefix, abd->stats);
+	}
+	rcu_read_unlock();
+
+	aoenet_stats_show(s);
+
+	return (0);
+}
+
+static int aoestats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, aoestats_seq_show, NULL);
+}
+
+static const struct file_operations aoestats_fops = {
+	.owner = THIS_MODULE,
+	.open = aoestats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Create aoeserver/stats in debugfs. The counters are kept even when
+ * debugfs isnt available, so this is not fatal. */
+int aoestats_init(void)
+{
+	aoestats_dir = debugfs_create_dir("aoeserver", NULL);
+	if (IS_ERR(aoestats_dir) || aoestats_dir == NULL) {
+		printk(KERN_INFO "aoeserver: debugfs not available, "
+		       "no stats file\n");
+		aoestats_dir = NULL;
+		return (-ENODEV);
+	}
+
+	aoestats_file = debugfs_create_file("stats", 0444, aoestats_dir,
+					    NULL, &aoestats_fops);
+
+	return (0);
+}
+
+void aoestats_exit(void)
+{
+	if (aoestats_file && !IS_ERR(aoestats_file))
+		debugfs_remove(aoestats_file);
+	if (aoestats_dir)
+		debugfs_remove(aoestats_dir);
+}
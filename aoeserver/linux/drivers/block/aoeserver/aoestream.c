@@ -0,0 +1,180 @@
+/*
+ *  linux/drivers/block/aoeserver/aoestream.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file do read-ahead for initiators reading a
+ * device sequentially. An initiator reading a large file sends a stream
+ * of small reads, spread over many tags, which arrive slightly out of
+ * order and are handled by several kaoed threads. The read-ahead of the
+ * shared struct file cant make sense of that, and page cache pages
+ * attached to replies (see bldev_readpages()) are not read ahead at all.
+ *
+ * Instead every device keeps track of a few streams, each one a source
+ * address and the sector after the furthest read in the stream. A read
+ * close to the end of a stream continues it, once a stream has been
+ * continued AOE_RA_MIN times it is read ahead into the page cache with a
+ * read-ahead state of its own. The reads that follow are then served from
+ * memory. Reads in streams are counted as hits when all their pages were
+ * cached already, and as misses otherwise.
+ *
+ * Only reads that go through the page cache are read ahead, reads that
+ * are submitted as bios go straight to the device.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/jiffies.h>
+
+#include "aoe.h"
+
+/* Find the stream a read of nsect sectors at lba from h_source belongs
+ * to, or start a new one in place of the least recently used. Called
+ * with ra_lock held. */
+static struct aoestream *aoestream_find(struct aoeblkdev *abd,
+					unsigned char *h_source,
+					u64 lba, unsigned int nsect)
+{
+	struct aoestream *s, *old = &abd->streams[0];
+	int i;
+
+	for (i = 0; i < AOE_RA_STREAMS; i++) {
+		s = &abd->streams[i];
+
+		if (s->used && memcmp(s->h_source, h_source, ETH_ALEN) == 0 &&
+		    lba + AOE_RA_SLACK >= s->next &&
+		    lba <= s->next + AOE_RA_SLACK) {
+			s->seq++;
+			if (lba + nsect > s->next)
+				s->next = lba + nsect;
+			s->used = jiffies | 1;
+			return (s);
+		}
+
+		if (old->used &&
+		    (s->used == 0 || time_before(s->used, old->used)))
+			old = s;
+	}
+
+	s = old;
+	memcpy(s->h_source, h_source, ETH_ALEN);
+	s->next = lba + nsect;
+	s->seq = 0;
+	s->used = jiffies | 1;	/* Never zero, that means unused */
+	file_ra_state_init(&s->ra, abd->fp->f_mapping);
+	s->ra.ra_pages = abd->ra_pages;
+
+	return (s);
+}
+
+/* Check if all pages from index to last are in the page cache */
+static int aoestream_cached(struct address_space *mapping, pgoff_t index,
+			    pgoff_t last)
+{
+	struct page *page;
+	int uptodate;
+
+	for (; index <= last; index++) {
+		page = find_get_page(mapping, index);
+		if (page == NULL)
+			return (0);
+
+		uptodate = PageUptodate(page);
+		page_cache_release(page);
+
+		if (!uptodate)
+			return (0);
+	}
+
+	return (1);
+}
+
+/* A read of len bytes at ppos is about to be done through the page
+ * cache, start read-ahead if it is part of a sequential stream. The
+ * read-ahead is asynchronous, we dont wait for any of it. */
+void aoestream_read(struct aoerequest *work, loff_t ppos, unsigned int len)
+{
+	struct aoeblkdev *abd = work->abd;
+	struct address_space *mapping = abd->fp->f_mapping;
+	struct aoestream *s;
+	struct page *page;
+	pgoff_t index, last;
+
+	if (abd->ra_pages == 0 || len == 0)
+		return;
+
+	index = ppos >> PAGE_CACHE_SHIFT;
+	last = (ppos + len - 1) >> PAGE_CACHE_SHIFT;
+
+	mutex_lock(&abd->ra_lock);
+
+	s = aoestream_find(abd, work->aoereq->eth.h_source, ppos >> 9,
+			   len >> 9);
+	if (s->seq < AOE_RA_MIN)
+		goto out;
+
+	aoestats_inc(work, aoestream_cached(mapping, index, last) ?
+		     AOESTAT_RAHIT : AOESTAT_RAMISS);
+
+	/* The same as do_generic_mapping_read(), a missing page starts
+	 * read-ahead and the marked page in a read-ahead window starts the
+	 * next window */
+	page = find_get_page(mapping, index);
+	if (page == NULL)
+		page_cache_sync_readahead(mapping, &s->ra, abd->fp, index,
+					  last - index + 1);
+	else {
+		if (PageReadahead(page))
+			page_cache_async_readahead(mapping, &s->ra, abd->fp,
+						   page, index,
+						   last - index + 1);
+		page_cache_release(page);
+	}
+
+      out:
+	mutex_unlock(&abd->ra_lock);
+}
+
+/* Set the size of the read-ahead window in pages, zero turns read-ahead
+ * off. The streams start over. */
+void aoestream_setra(struct aoeblkdev *abd, unsigned long pages)
+{
+	mutex_lock(&abd->ra_lock);
+	abd->ra_pages = pages;
+	memset(abd->streams, 0, sizeof(abd->streams));
+	mutex_unlock(&abd->ra_lock);
+}
+
+/* Count the streams that are being read ahead. This is only for
+ * /proc/aoeserver, which cant sleep, so the streams arent locked. */
+int aoestream_count(struct aoeblkdev *abd)
+{
+	int i, n = 0;
+
+	for (i = 0; i < AOE_RA_STREAMS; i++)
+		if (abd->streams[i].used && abd->streams[i].seq >= AOE_RA_MIN)
+			n++;
+
+	return (n);
+}
+
+void aoestream_init(struct aoeblkdev *abd)
+{
+	mutex_init(&abd->ra_lock);
+	abd->ra_pages = AOE_RA_DEFAULT / PAGE_CACHE_SIZE;
+	memset(abd->streams, 0, sizeof(abd->streams));
+}
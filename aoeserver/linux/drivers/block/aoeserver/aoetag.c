@@ -0,0 +1,311 @@
+/*
+ *  linux/drivers/block/aoeserver/aoetag.c
+ *
+ *  Implementation of an in kernel Ata Over Ethernet storage target for Linux.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file deal with retransmitted requests. An
+ * initiator sends a request again, with the same tag, when the reply is
+ * late. When the disk is what makes it late, handling the retransmit as
+ * a new request only adds to the load.
+ *
+ * Every device keeps its ata requests in a hash on source address and
+ * tag while they are in flight, and a retransmit of a request in flight
+ * is dropped, the reply to the first one will answer it. An initiator
+ * that retransmitted once is likely to do it again, so the replies to
+ * reads and identify requests that saw a retransmit are kept for
+ * AOE_REPLAY_TIME after they were sent, a retransmit that arrives after
+ * the reply (which the initiator never saw) is answered with a copy of
+ * the reply straight from the receive path. Keeping every reply would
+ * cost a clone per read and hold on to the reply skbs, which then cant
+ * be recycled. Initiators reuse tags, so the ata-header of a request has
+ * to match as well for it to be taken as a retransmit.
+ *
+ * aoetag_dup() and aoetag_add() run in softirq-context, the rest in
+ * process context.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+
+#include "aoe.h"
+
+/* A reply kept for retransmits */
+struct aoereplay {
+	struct hlist_node node;	/* Entry in the replay hash */
+	struct list_head lru;	/* Oldest first */
+	unsigned char h_source[ETH_ALEN];
+	u32 tag;
+	struct aoe_atahdr ata;	/* Of the request */
+	struct sk_buff *skb;	/* Clone of the reply */
+	unsigned long expires;
+};
+
+static inline struct hlist_head *aoetag_bucket(struct hlist_head *hash,
+					       unsigned char *h_source,
+					       u32 tag)
+{
+	return (&hash[hash_long(tag ^ (h_source[4] << 8 | h_source[5]),
+				AOE_TAG_BITS)]);
+}
+
+/* Check if two requests come from the same source, carry the same tag
+ * and ask for the same thing */
+static inline int aoetag_match(struct aoe_hdr *a, struct aoe_hdr *b)
+{
+	return (a->tag == b->tag &&
+		memcmp(a->eth.h_source, b->eth.h_source, ETH_ALEN) == 0 &&
+		memcmp(a + 1, b + 1, sizeof(struct aoe_atahdr)) == 0);
+}
+
+static void aoetag_free(struct aoeblkdev *abd, struct aoereplay *r)
+{
+	hlist_del(&r->node);
+	list_del(&r->lru);
+	abd->nreplay--;
+	kfree_skb(r->skb);
+	kfree(r);
+}
+
+/* Find the kept reply for a retransmit that came in on ifp and return a
+ * copy of it to send, or NULL if there is none. Called with tag_lock
+ * held. */
+static struct sk_buff *aoetag_replay(struct aoeblkdev *abd,
+				     struct net_device *ifp,
+				     struct aoe_hdr *h)
+{
+	struct aoereplay *r;
+	struct hlist_node *node, *n;
+
+	hlist_for_each_entry_safe(r, node, n,
+				  aoetag_bucket(abd->replays, h->eth.h_source,
+						h->tag), node) {
+		if (time_after(jiffies, r->expires)) {
+			aoetag_free(abd, r);
+			continue;
+		}
+
+		if (r->tag != h->tag ||
+		    memcmp(r->h_source, h->eth.h_source, ETH_ALEN) != 0 ||
+		    memcmp(&r->ata, h + 1, sizeof(r->ata)) != 0)
+			continue;
+
+		/* The reply has to leave where the retransmit came in */
+		if (r->skb->dev != ifp)
+			return (NULL);
+
+		return (skb_clone(r->skb, GFP_ATOMIC));
+	}
+
+	return (NULL);
+}
+
+/* Check if the request h, which came in on ifp, is a retransmit. Returns
+ * the counter to bump for it, with *skb set to the copy of the kept
+ * reply to send for AOESTAT_DUPREPLAY, or -1 if the request is new.
+ * Called with tag_lock held. */
+static int aoetag_lookup(struct aoeblkdev *abd, struct net_device *ifp,
+			 struct aoe_hdr *h, struct sk_buff **skb)
+{
+	struct aoerequest *w;
+	struct hlist_node *node;
+
+	/* The request skb of a request in flight is left untouched until
+	 * aoexmit() has taken it out of the table */
+	hlist_for_each_entry(w, node,
+			     aoetag_bucket(abd->inflight, h->eth.h_source,
+					   h->tag), tagnode)
+	    if (aoetag_match(h, (struct aoe_hdr *)skb_mac_header(w->skb_req))) {
+		w->retried = 1;
+		return (AOESTAT_DUPDROP);
+	}
+
+	if (abd->nreplay && (*skb = aoetag_replay(abd, ifp, h)) != NULL)
+		return (AOESTAT_DUPREPLAY);
+
+	return (-1);
+}
+
+/* A retransmit has been taken care of, send the kept reply if there is
+ * one and count it */
+static void aoetag_done(struct aoeblkdev *abd, struct aoeif *aif,
+			struct sk_buff *skb, int what)
+{
+	if (skb)
+		dev_queue_xmit(skb);
+
+	aoestats_add(abd->stats, what, 1);
+	if (aif)
+		aoestats_add(aif->stats, what, 1);
+}
+
+/* Check if a request is a retransmit that has been taken care of, before
+ * it takes a slot in the queue of the device. A retransmit must not be
+ * dropped because the queue is full of the requests it repeats. Returns
+ * -1 if it is, the caller drops it. Called from aoewq_addreq(). */
+int aoetag_dup(struct aoeblkdev *abd, struct sk_buff *req,
+	       struct net_device *ifp, struct aoeif *aif)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)skb_mac_header(req);
+	struct sk_buff *skb = NULL;
+	int what;
+
+	if (h->cmd != AOE_CMD_ATA)
+		return (0);
+
+	spin_lock_bh(&abd->tag_lock);
+	what = aoetag_lookup(abd, ifp, h, &skb);
+	spin_unlock_bh(&abd->tag_lock);
+
+	if (what < 0)
+		return (0);
+
+	aoetag_done(abd, aif, skb, what);
+	return (-1);
+}
+
+/* Enter a request into the table of requests in flight. Returns zero if
+ * the request is new, or -1 if it is a retransmit that has been taken
+ * care of, the caller drops it. The same retransmit may have come in on
+ * another cpu since aoetag_dup(), so the table is checked again. Called
+ * from aoewq_addreq(). */
+int aoetag_add(struct aoerequest *work)
+{
+	struct aoeblkdev *abd = work->abd;
+	struct aoe_hdr *h = (struct aoe_hdr *)skb_mac_header(work->skb_req);
+	struct sk_buff *skb = NULL;
+	int what;
+
+	work->tagged = 0;
+	work->retried = 0;
+
+	if (h->cmd != AOE_CMD_ATA)
+		return (0);
+
+	spin_lock_bh(&abd->tag_lock);
+
+	what = aoetag_lookup(abd, work->ifp, h, &skb);
+	if (what < 0) {
+		hlist_add_head(&work->tagnode,
+			       aoetag_bucket(abd->inflight, h->eth.h_source,
+					     h->tag));
+		work->tagged = 1;
+	}
+
+	spin_unlock_bh(&abd->tag_lock);
+
+	if (what < 0)
+		return (0);
+
+	aoetag_done(abd, work->aif, skb, what);
+	return (-1);
+}
+
+/* The request is done, take it out of the table. This has to happen
+ * before the reply is sent, the reply may overwrite the request skb. */
+void aoetag_del(struct aoerequest *work)
+{
+	if (!work->tagged)
+		return;
+
+	spin_lock_bh(&work->abd->tag_lock);
+	hlist_del(&work->tagnode);
+	spin_unlock_bh(&work->abd->tag_lock);
+
+	work->tagged = 0;
+}
+
+/* Keep a copy of the reply to a read or identify request that has been
+ * retransmitted, which is about to be sent, for further retransmits.
+ * Called from aoexmit(). */
+void aoetag_keep(struct aoerequest *work)
+{
+	struct aoeblkdev *abd = work->abd;
+	struct aoe_hdr *h = work->aoereq;
+	struct aoe_atahdr *ata = work->atarequest;
+	struct aoereplay *r;
+
+	if (!work->tagged || !work->retried || work->skb_rep == NULL)
+		return;
+
+	if (aoeproto_rw(ata) != AOEPROTO_READ && ata->cmdstat != WIN_IDENTIFY)
+		return;
+
+	/* Errors are worth trying again */
+	if ((work->aoerep->ver_flags & AOE_FLAG_ERR) ||
+	    (work->atareply->cmdstat & ERR_STAT))
+		return;
+
+	r = kmalloc(sizeof(*r), GFP_ATOMIC);
+	if (r == NULL)
+		return;
+
+	r->skb = skb_clone(work->skb_rep, GFP_ATOMIC);
+	if (r->skb == NULL) {
+		kfree(r);
+		return;
+	}
+
+	memcpy(r->h_source, h->eth.h_source, ETH_ALEN);
+	r->tag = h->tag;
+	memcpy(&r->ata, ata, sizeof(r->ata));
+	r->expires = jiffies + AOE_REPLAY_TIME;
+
+	spin_lock_bh(&abd->tag_lock);
+
+	/* Make room, expired replies go first since they are the oldest */
+	while (!list_empty(&abd->replay_lru)) {
+		struct aoereplay *old = list_entry(abd->replay_lru.next,
+						   struct aoereplay, lru);
+
+		if (abd->nreplay < AOE_REPLAY_MAX &&
+		    time_before_eq(jiffies, old->expires))
+			break;
+		aoetag_free(abd, old);
+	}
+
+	hlist_add_head(&r->node, aoetag_bucket(abd->replays, r->h_source,
+					       r->tag));
+	list_add_tail(&r->lru, &abd->replay_lru);
+	abd->nreplay++;
+
+	spin_unlock_bh(&abd->tag_lock);
+}
+
+void aoetag_init(struct aoeblkdev *abd)
+{
+	int i;
+
+	spin_lock_init(&abd->tag_lock);
+	for (i = 0; i < AOE_TAG_HASH; i++) {
+		INIT_HLIST_HEAD(&abd->inflight[i]);
+		INIT_HLIST_HEAD(&abd->replays[i]);
+	}
+	INIT_LIST_HEAD(&abd->replay_lru);
+	abd->nreplay = 0;
+}
+
+/* Drop the kept replies of a device that is going away, there are no
+ * requests in flight anymore */
+void aoetag_exit(struct aoeblkdev *abd)
+{
+	spin_lock_bh(&abd->tag_lock);
+	while (!list_empty(&abd->replay_lru))
+		aoetag_free(abd, list_entry(abd->replay_lru.next,
+					    struct aoereplay, lru));
+	spin_unlock_bh(&abd->tag_lock);
+}
@@ -15,120 +15,447 @@
 
 /*
  * The functions in this file handles the workqueues used by the aoeserver. 
- * They will start and stop the worker-thread and add jobs to the queue.
- * 
+ * They will start and stop the worker-threads and add jobs to the queue.
+ * There is one kaoed-thread per cpu, shared by all exported devices. A
+ * request is normally handled on the cpu that recieved it, unless the
+ * device has been restricted to a set of cpus.
  */
 
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/sched.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 
 #include "aoe.h"
 
-/* Create the workqueue and name it 'kaoed[MAJOR:MINOR];' */
-void aoewq_init(struct aoeblkdev *blkdev)
+/* All struct aoerequest come from here, through the per device pools */
+static struct kmem_cache *aoereq_cache = NULL;
+
+/* A kaoed worker thread bound to one cpu */
+struct aoeworker {
+	spinlock_t lock;		/* Protects queue */
+	struct list_head queue;		/* Requests waiting for the thread */
+	wait_queue_head_t wait;
+	struct task_struct *task;
+	int cpu;
+	struct sk_buff_head xmitq;	/* Replies to send after this pass */
+	struct aoeblkdev *plugged[AOE_PLUGMAX];	/* Unplugged after this pass */
+	int nplugged;
+};
+
+static struct aoeworker *aoeworkers[NR_CPUS];
+
+/* Flush threads, shared by all devices, see aoeflush.c */
+struct workqueue_struct *aoe_flushwq = NULL;
+
+/* Background writes of the devices, see aoeasync.c and aoecache.c.
+ * These wait for the disk, and a flush waits for them, so they cant
+ * run on aoe_flushwq or on the kernel workqueue. */
+struct workqueue_struct *aoe_iowq = NULL;
+
+int aoewq_cacheinit(void)
 {
-	char buff[32];
+	aoereq_cache = kmem_cache_create("aoerequest",
+					 sizeof(struct aoerequest), 0, 0, NULL);
+	if (aoereq_cache == NULL) {
+		printk(KERN_ERR "aoewq_cacheinit(): Failed to create cache\n");
+		return (-ENOMEM);
+	}
 
-	if (blkdev) {
-		sprintf(buff, "kaoed[%d:%d]", blkdev->shelf, blkdev->slot);
+	return (0);
+}
+
+void aoewq_cacheexit(void)
+{
+	if (aoereq_cache)
+		kmem_cache_destroy(aoereq_cache);
+	aoereq_cache = NULL;
+}
+
+/* mempool_alloc() always tries the allocator before the reserve. We only
+ * want to hit the slab when the pool is created or resized, from the
+ * receive path (which cant wait) requests are taken from the reserve so
+ * that the steady state doesnt allocate anything at all. */
+static void *aoereq_pool_alloc(gfp_t gfp_mask, void *data)
+{
+	if (!(gfp_mask & __GFP_WAIT))
+		return (NULL);
+
+	return (kmem_cache_alloc(aoereq_cache, gfp_mask));
+}
+
+static void aoereq_pool_free(void *element, void *data)
+{
+	kmem_cache_free(aoereq_cache, element);
+}
+
+/* Make room for qdepth requests in the pool of the device */
+int aoewq_resize(struct aoeblkdev *blkdev, int qdepth)
+{
+	if (blkdev->reqpool == NULL)
+		return (-EINVAL);
+
+	return (mempool_resize(blkdev->reqpool, qdepth, GFP_KERNEL));
+}
+
+/* The main loop of the kaoed threads. Everything queued since the last
+ * pass is taken off the queue at once and handled in order. */
+static int aoeworker_thread(void *data)
+{
+	struct aoeworker *w = data;
+	struct aoerequest *work, *n;
+	LIST_HEAD(batch);
+	int i;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(w->wait, !list_empty(&w->queue) ||
+					 kthread_should_stop());
+
+		spin_lock_irq(&w->lock);
+		list_splice_init(&w->queue, &batch);
+		spin_unlock_irq(&w->lock);
+
+		list_for_each_entry_safe(work, n, &batch, list) {
+			list_del(&work->list);
+			work->fn(work);
+		}
+
+		/* Start the disks on the bios of this pass. The devices
+		 * cant go away yet, the bios hold requests in their queue
+		 * and complete to this thread. */
+		for (i = 0; i < w->nplugged; i++)
+			bldev_unplug(w->plugged[i]);
+		w->nplugged = 0;
+
+		/* Send all the replies from this pass in one go */
+		aoenet_xmit(&w->xmitq);
+	}
+
+	return (0);
+}
+
+/* Start one kaoed thread per online cpu, its data is allocated on the
+ * node of the cpu it serves */
+int aoewq_startworkers(void)
+{
+	struct aoeworker *w;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		w = kmalloc_node(sizeof(*w), GFP_KERNEL, cpu_to_node(cpu));
+		if (w == NULL)
+			goto fail;
+
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->queue);
+		init_waitqueue_head(&w->wait);
+		skb_queue_head_init(&w->xmitq);
+		w->nplugged = 0;
+		w->cpu = cpu;
+
+		w->task = kthread_create(aoeworker_thread, w, "kaoed/%d", cpu);
+		if (IS_ERR(w->task)) {
+			kfree(w);
+			goto fail;
+		}
+
+		kthread_bind(w->task, cpu);
+		aoeworkers[cpu] = w;
+		wake_up_process(w->task);
+	}
+
+	return (0);
+
+      fail:
+	printk(KERN_ERR "aoewq_startworkers(): Failed to start kaoed\n");
+	aoewq_stopworkers();
+	return (-ENOMEM);
+}
+
+/* Stop the kaoed threads, all devices must be gone by now */
+void aoewq_stopworkers(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if (aoeworkers[cpu] == NULL)
+			continue;
+
+		kthread_stop(aoeworkers[cpu]->task);
+		kfree(aoeworkers[cpu]);
+		aoeworkers[cpu] = NULL;
+	}
+}
+
+/* Start the workqueues that do the blocking work of the devices next
+ * to kaoed */
+int aoewq_startqueues(void)
+{
+	aoe_flushwq = create_workqueue("aoeflush");
+	if (aoe_flushwq == NULL)
+		goto fail;
+
+	aoe_iowq = create_workqueue("aoeio");
+	if (aoe_iowq == NULL)
+		goto fail;
+
+	return (0);
+
+      fail:
+	printk(KERN_ERR "aoewq_startqueues(): Failed to create workqueue\n");
+	aoewq_stopqueues();
+	return (-ENOMEM);
+}
+
+/* Stop the workqueues, all devices must be gone by now */
+void aoewq_stopqueues(void)
+{
+	if (aoe_flushwq)
+		destroy_workqueue(aoe_flushwq);
+	aoe_flushwq = NULL;
 
-		printk(KERN_NOTICE,"Starting %s\n", buff);
-		blkdev->kaoed_wq = create_workqueue(buff);
+	if (aoe_iowq)
+		destroy_workqueue(aoe_iowq);
+	aoe_iowq = NULL;
+}
+
+/* Pick the cpu a request for this device is handled on. By default that
+ * is the cpu the packet came in on, so that the request stays in the
+ * same cache as the driver left it in. Devices restricted to a set of
+ * cpus spread their requests over that set by tag. */
+static int aoewq_pickcpu(struct aoeblkdev *abd, struct sk_buff *skb)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)skb_mac_header(skb);
+	cpumask_t cpus = abd->cpus;
+	int cpu = smp_processor_id();
+	int n;
+
+	if (cpus_empty(cpus) || cpu_isset(cpu, cpus))
+		return (cpu);
+
+	n = ntohl(h->tag) % cpus_weight(cpus);
+	for_each_cpu_mask(cpu, cpus)
+	    if (n-- == 0)
+		break;
+
+	return (cpu);
+}
+
+/* Queue a request with a kaoed thread, fn is called with the request in
+ * the context of the thread. This may be called from any context. */
+void aoewq_queue(struct aoerequest *work, void (*fn)(struct aoerequest *))
+{
+	struct aoeworker *w = aoeworkers[work->cpu];
+	unsigned long flags;
+	int wake;
+	int cpu;
+
+	/* The cpu may have gone away, fall back to any running worker */
+	for (cpu = 0; w == NULL && cpu < NR_CPUS; cpu++)
+		w = aoeworkers[cpu];
+
+	work->fn = fn;
+
+	spin_lock_irqsave(&w->lock, flags);
+	wake = list_empty(&w->queue);
+	list_add_tail(&work->list, &w->queue);
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	if (wake)
+		wake_up(&w->wait);
+}
+
+/* Queue a reply to be sent at the end of the current pass of the kaoed
+ * thread we are running in. Returns -1 if we are not in a kaoed thread,
+ * the caller has to send the reply itself. */
+int aoewq_xmit(struct sk_buff *skb)
+{
+	struct aoeworker *w = aoeworkers[raw_smp_processor_id()];
+
+	/* The threads are bound to their cpu, so this is stable */
+	if (w == NULL || w->task != current)
+		return (-1);
+
+	__skb_queue_tail(&w->xmitq, skb);
+	return (0);
+}
+
+/* Keep the queue of a device plugged until the end of the current pass
+ * of the kaoed thread we are running in, so that the bios of adjacent
+ * requests in the pass can be merged. Returns 1 if the device is new to
+ * this pass and its queue should be plugged, 0 if it is plugged already,
+ * or -1 if the caller has to unplug the queue itself. */
+int aoewq_plug(struct aoeblkdev *abd)
+{
+	struct aoeworker *w = aoeworkers[raw_smp_processor_id()];
+	int i;
+
+	if (w == NULL || w->task != current)
+		return (-1);
+
+	for (i = 0; i < w->nplugged; i++)
+		if (w->plugged[i] == abd)
+			return (0);
+
+	if (w->nplugged == AOE_PLUGMAX)
+		return (-1);
+
+	w->plugged[w->nplugged++] = abd;
+	return (1);
+}
+
+/* Setup the request pool for a newly exported device */
+void aoewq_init(struct aoeblkdev *blkdev)
+{
+	if (blkdev) {
+		init_completion(&blkdev->qdone);
 
-		if (blkdev->kaoed_wq == NULL)
+		/* One preallocated request for every slot in the queue */
+		blkdev->reqpool = mempool_create(blkdev->qdepth,
+						 aoereq_pool_alloc,
+						 aoereq_pool_free, NULL);
+		if (blkdev->reqpool == NULL)
 			printk(KERN_ERR
-			       "aoewq_init(): Failed to start workqueue\n");
+			       "aoewq_init(): Failed to create request pool\n");
 	} else
 		printk(KERN_ERR "aoewq_init(): blkdev == NULL\n");
 
 }
 
-/* Kill the workqueue process */
+/* Wait for all requests to a device that is going away to finish */
 void aoewq_exit(struct aoeblkdev *blkdev)
 {
 
-	if (blkdev && blkdev->kaoed_wq) {
-
-		printk("Stopping kaoed[%d:%d]\n", blkdev->shelf, blkdev->slot);
+	if (blkdev) {
 
-		/* Flush the workqueue before removing it */
-		flush_workqueue(blkdev->kaoed_wq);
+		/* Every queued request holds a slot in the queue until its 
+		 * reply has been sent, including requests waiting for bios.
+		 * The count only drops to zero once we have let go of our
+		 * own slot, so whoever gets it there is the last one to
+		 * touch the device, and completes qdone for us. */
+		if (!atomic_dec_and_test(&blkdev->queuecounter))
+			wait_for_completion(&blkdev->qdone);
 
-		/* Remove the workque */
-		destroy_workqueue(blkdev->kaoed_wq);
+		/* Every request has been returned to the pool by now */
+		if (blkdev->reqpool)
+			mempool_destroy(blkdev->reqpool);
+		blkdev->reqpool = NULL;
 
 		return;
 	} else
-		printk(KERN_ERR
-		       "aoewq_exit(): exit called when kaoed_wq == NULL!\n");
+		printk(KERN_ERR "aoewq_exit(): blkdev == NULL!\n");
 
 }
 
 /* Add work to the workque - called from aoenet.c */
 /* This function is executed in softirq-context when a packet arrieves */
 void aoewq_addreq(struct sk_buff *skb, struct net_device *ifp,
-		  struct aoeblkdev *abd)
+		  struct aoeif *aif, struct aoeblkdev *abd)
 {
 	struct aoerequest *workreq;
 
-	if (abd && atomic_read(&abd->queuecounter) > 20) {
-		printk(KERN_ERR "aoewq_addwork(): aoequeue to large %d\n",
-		       atomic_read(&abd->queuecounter));
+	if (abd == NULL) {
+		dev_kfree_skb(skb);
+		return;
+	}
+
+	aoestats_add(abd->stats, AOESTAT_RX, 1);
 
+	/* Retransmits of requests we are already working on are dropped,
+	 * before they can be turned away by a full queue */
+	if (aoetag_dup(abd, skb, ifp, aif) != 0) {
 		dev_kfree_skb(skb);
 		return;
 	}
 
-	workreq = kmalloc(sizeof(*workreq), GFP_ATOMIC);
+	/* The request counts against the queue until its reply has been
+	 * sent, see aoereq_destroy() */
+	if (atomic_inc_return(&abd->queuecounter) - 1 > abd->qdepth) {
+		atomic_dec(&abd->queuecounter);
+		aoestats_add(abd->stats, AOESTAT_QFULL, 1);
+		aoestats_add(abd->stats, AOESTAT_DROP, 1);
+		if (aif) {
+			aoestats_add(aif->stats, AOESTAT_QFULL, 1);
+			aoestats_add(aif->stats, AOESTAT_DROP, 1);
+		}
+
+		if (printk_ratelimit())
+			printk(KERN_ERR
+			       "aoewq_addwork(): aoequeue to large %d\n",
+			       abd->qdepth);
+
+		dev_kfree_skb(skb);
+		return;
+	}
+
+	workreq = NULL;
+	if (abd->reqpool)
+		workreq = mempool_alloc(abd->reqpool, GFP_ATOMIC);
 	if (!workreq) {
-		printk(KERN_ERR
-		       "aoewq_addwork(): Failed to allocate workrequest!\n");
+		if (printk_ratelimit())
+			printk(KERN_ERR
+			       "aoewq_addwork(): Failed to allocate workrequest!\n");
+		atomic_dec(&abd->queuecounter);
+		aoestats_add(abd->stats, AOESTAT_NOMEM, 1);
+		aoestats_add(abd->stats, AOESTAT_DROP, 1);
+		if (aif) {
+			aoestats_add(aif->stats, AOESTAT_NOMEM, 1);
+			aoestats_add(aif->stats, AOESTAT_DROP, 1);
+		}
 		dev_kfree_skb(skb);
 		return;		/* -ENOMEM; */
 	}
 
-	/* Create the work-struct */
-	/* aoepacket() will be called with the workreq struct 
-	 * as an argument in the context of our kaoed-kernel-thread
+	/* kaoed() will be called with the workreq struct 
+	 * as an argument in the context of a kaoed-kernel-thread
 	 * at an approriate time in the future. */
 
-	INIT_WORK(&workreq->work, kaoed );
-
 	workreq->skb_req = skb;
 	workreq->ifp = ifp;
+	workreq->aif = aif;
+	workreq->t_rx = ktime_get();
+	workreq->t_io = ktime_set(0, 0);
 	workreq->skb_rep = NULL;
 	workreq->abd = abd;
+	workreq->cpu = aoewq_pickcpu(abd, skb);
 
-	if ((abd != NULL) &&
-	    (abd->kaoed_wq != NULL) &&
-	    queue_work(abd->kaoed_wq, &workreq->work)) {
-		/* Increment queue-counter */
-		atomic_inc(&abd->queuecounter);
-	} else {
-		printk("aoewq_addreq() failed to submit request to queue!\n");
-		aoereq_destroy(workreq);
+	/* Unless one came in on another cpu since aoetag_dup() */
+	if (aoetag_add(workreq) != 0) {
+		mempool_free(workreq, abd->reqpool);
+		aoedecqueue(abd);
+		dev_kfree_skb(skb);
+		return;
 	}
 
-	/* The workqreq-struct will be kfree():d later */
+	aoe_trace(aoeserver_enqueue, (struct aoe_hdr *)skb_mac_header(skb));
+
+	aoewq_queue(workreq, kaoed);
+
+	/* The workqreq-struct will be returned to the pool later */
 	return;
 }
 
-/* When the jobb is done this function is called to decrease the
- * queuecounter so that we can take on more work */
+/* When the jobb is done and the reply has been sent this function is 
+ * called to decrease the queuecounter so that we can take on more work */
 void aoedecqueue(struct aoeblkdev *abd)
 {
-	if (abd != NULL)
-		atomic_dec(&abd->queuecounter);
+	/* Only drops to zero when aoewq_exit() is waiting for the queue
+	 * to drain, the device may be freed as soon as it is told */
+	if (abd != NULL && atomic_dec_and_test(&abd->queuecounter))
+		complete(&abd->qdone);
 }
 
 /* Return the number of packets in the queue */
 int aoecheckqueue(struct aoeblkdev *abd)
 {
 	if (abd != NULL)
-		return (atomic_read(&abd->queuecounter));
+		return (atomic_read(&abd->queuecounter) - 1);
 	else
 		return (0);
 }
@@ -136,11 +463,27 @@ int aoecheckqueue(struct aoeblkdev *abd)
 /* Free a work-request and the skb it points to */
 void aoereq_destroy(struct aoerequest *workreq)
 {
-	if (workreq && workreq->skb_req != NULL)
+	struct aoeblkdev *abd;
+
+	if (workreq == NULL)
+		return;
+
+	abd = workreq->abd;
+
+	aoetag_del(workreq);
+
+	if (workreq->skb_req != NULL)
 		dev_kfree_skb(workreq->skb_req);
 
-	if (workreq && workreq->skb_rep != NULL)
-		dev_kfree_skb(workreq->skb_rep);
+	/* An unsent reply can be used again */
+	if (workreq->skb_rep != NULL) {
+		aoestats_inc(workreq, AOESTAT_DROP);
+		aoeskb_recycle(workreq->skb_rep);
+	}
+
+	mempool_free(workreq, abd->reqpool);
 
-	kfree(workreq);
+	/* Make room in the queue, this has to come last since aoewq_exit()
+	 * may free the device as soon as the queue is empty */
+	aoedecqueue(abd);
 }
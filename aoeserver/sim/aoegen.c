@@ -0,0 +1,254 @@
+/*
+ *  sim/aoegen.c
+ *
+ * Userspace simulator for the ATA over Ethernet storage target.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * The functions in this file make up the traffic the simulator is driven
+ * with, either generated from a description of the load or read from a
+ * pcap file captured on a real aoe network. All frames are built up
+ * front so that building them doesnt show up in the measurements, the
+ * simulator replays them over and over for as long as it runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "aoesim.h"
+
+static const unsigned char gen_initiator[ETH_ALEN] = { 2, 0, 0, 0, 0, 1 };
+static const unsigned char gen_target[ETH_ALEN] = { 2, 0, 0, 0, 0, 2 };
+
+/* A small and fast random number generator (xorshift) */
+static u64 gen_random(u64 *state)
+{
+	u64 x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return (x);
+}
+
+/* Keep a copy of the first len bytes of frame */
+static int gen_add(struct simframes *f, unsigned char *frame, unsigned int len)
+{
+	unsigned long n = f->count;
+	unsigned char *copy;
+
+	if ((copy = malloc(len)) == NULL)
+		return (-1);
+	memcpy(copy, frame, len);
+
+	if ((n & (n - 1)) == 0) {
+		unsigned long size = n ? n * 2 : 64;
+
+		f->frame = realloc(f->frame, size * sizeof(*f->frame));
+		f->len = realloc(f->len, size * sizeof(*f->len));
+		if (f->frame == NULL || f->len == NULL)
+			return (-1);
+	}
+
+	f->frame[n] = copy;
+	f->len[n] = len;
+	f->count++;
+
+	return (0);
+}
+
+/* Start a request frame to the device of the generator */
+static struct aoe_hdr *gen_hdr(unsigned char *frame, struct simgen *g,
+			       int cmd, u32 tag)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)frame;
+
+	memcpy(h->eth.h_dest, gen_target, ETH_ALEN);
+	memcpy(h->eth.h_source, gen_initiator, ETH_ALEN);
+	h->eth.h_proto = cpu_to_be16(PRIV_ETH_P_AOE);
+	h->ver_flags = 0x10;	/* AOE Version one */
+	h->error = 0;
+	h->shelf = cpu_to_be16(g->shelf);
+	h->slot = g->slot;
+	h->cmd = cmd;
+	h->tag = cpu_to_be32(tag);
+
+	return (h);
+}
+
+/* Build an ata request, with write data if it is a write */
+static unsigned int gen_ata(unsigned char *frame, struct simgen *g, u32 tag,
+			    int cmd, u64 lba, int nsect)
+{
+	struct aoe_atahdr *ata;
+	unsigned int len;
+	int i;
+
+	gen_hdr(frame, g, AOE_CMD_ATA, tag);
+	ata = (struct aoe_atahdr *)(frame + sizeof(struct aoe_hdr));
+	memset(ata, 0, sizeof(*ata));
+
+	ata->flags = AOE_ATAFLAG_LBA48;
+	ata->nsect = nsect;
+	ata->cmdstat = cmd;
+	for (i = 0; i < 6; i++)
+		ata->lba[i] = lba >> (i * 8);
+
+	len = sizeof(struct aoe_hdr) + sizeof(struct aoe_atahdr);
+	if (aoeproto_rw(ata) == AOEPROTO_WRITE) {
+		ata->flags |= AOE_ATAFLAG_WRITE;
+		memset(frame + len, tag & 0xff, nsect * 512);
+		len += nsect * 512;
+	}
+
+	return (len);
+}
+
+/* Build a config read query */
+static unsigned int gen_cfg(unsigned char *frame, struct simgen *g, u32 tag)
+{
+	struct aoe_cfghdr *cfg;
+
+	gen_hdr(frame, g, AOE_CMD_CFG, tag);
+	cfg = (struct aoe_cfghdr *)(frame + sizeof(struct aoe_hdr));
+	memset(cfg, 0, sizeof(*cfg));
+
+	return (sizeof(struct aoe_hdr) + sizeof(struct aoe_cfghdr));
+}
+
+/* Generate the frames described by g */
+int simgen_build(struct simgen *g, struct simframes *f)
+{
+	static unsigned char frame[SIM_MAXFRAME];
+	unsigned long i;
+	unsigned int len;
+	u64 state = 0x2545f4914f6cdd1dULL;
+	u64 lba = 0, span;
+	int pick;
+
+	memset(f, 0, sizeof(*f));
+
+	span = g->size > (u64)g->nsect ? g->size - g->nsect : 1;
+
+	for (i = 0; i < g->frames; i++) {
+		if (g->sequential) {
+			lba = (lba + g->nsect) % span;
+		} else
+			lba = gen_random(&state) % span;
+
+		pick = gen_random(&state) % 100;
+		if (pick < g->reads)
+			len = gen_ata(frame, g, i, WIN_READ_EXT, lba, g->nsect);
+		else if ((pick -= g->reads) < g->configs)
+			len = gen_cfg(frame, g, i);
+		else if ((pick -= g->configs) < g->identifies)
+			len = gen_ata(frame, g, i, WIN_IDENTIFY, 0, 1);
+		else if ((pick -= g->identifies) < g->flushes)
+			len = gen_ata(frame, g, i, WIN_FLUSH_CACHE_EXT, 0, 0);
+		else
+			len = gen_ata(frame, g, i, g->fua ?
+				      AOE_ATA_WRITE_FUA_EXT : WIN_WRITE_EXT,
+				      lba, g->nsect);
+
+		if (gen_add(f, frame, len) != 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/* Read the aoe requests from a pcap file, anything else in it is
+ * skipped. Only the classic pcap format with ethernet frames is read. */
+int simgen_pcap(const char *path, struct simframes *f)
+{
+	struct {
+		u32 magic;
+		u16 major, minor;
+		u32 zone, sigfigs, snaplen, linktype;
+	} ghdr;
+	struct {
+		u32 sec, usec, caplen, len;
+	} rhdr;
+	static unsigned char frame[SIM_MAXFRAME];
+	struct aoe_hdr *h;
+	FILE *fp;
+	int swap;
+
+	memset(f, 0, sizeof(*f));
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		perror(path);
+		return (-1);
+	}
+
+	if (fread(&ghdr, sizeof(ghdr), 1, fp) != 1)
+		goto bad;
+
+	if (ghdr.magic == 0xa1b2c3d4)
+		swap = 0;
+	else if (ghdr.magic == 0xd4c3b2a1)
+		swap = 1;
+	else
+		goto bad;
+
+	if ((swap ? __builtin_bswap32(ghdr.linktype) : ghdr.linktype) != 1) {
+		fprintf(stderr, "%s: not an ethernet capture\n", path);
+		goto out;
+	}
+
+	while (fread(&rhdr, sizeof(rhdr), 1, fp) == 1) {
+		if (swap)
+			rhdr.caplen = __builtin_bswap32(rhdr.caplen);
+
+		if (rhdr.caplen > SIM_MAXFRAME) {
+			fseek(fp, rhdr.caplen, SEEK_CUR);
+			continue;
+		}
+
+		if (fread(frame, rhdr.caplen, 1, fp) != 1)
+			break;
+
+		/* Requests only, the replies are what we are here to make */
+		h = (struct aoe_hdr *)frame;
+		if (rhdr.caplen < sizeof(*h) ||
+		    h->eth.h_proto != cpu_to_be16(PRIV_ETH_P_AOE) ||
+		    (h->ver_flags & AOE_FLAG_RSP))
+			continue;
+
+		if (gen_add(f, frame, rhdr.caplen) != 0)
+			goto out;
+	}
+
+	fclose(fp);
+	return (0);
+
+      bad:
+	fprintf(stderr, "%s: not a pcap file\n", path);
+      out:
+	fclose(fp);
+	return (-1);
+}
+
+void simgen_free(struct simframes *f)
+{
+	unsigned long i;
+
+	for (i = 0; i < f->count; i++)
+		free(f->frame[i]);
+	free(f->frame);
+	free(f->len);
+	memset(f, 0, sizeof(*f));
+}
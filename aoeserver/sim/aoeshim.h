@@ -0,0 +1,58 @@
+/*
+ *  sim/aoeshim.h
+ *
+ * Userspace simulator for the ATA over Ethernet storage target.
+ */
+
+ /*
+  * This program is free software; you can redistribute it and/or
+  * modify it under the terms of the GNU General Public License
+  * as published by the Free Software Foundation; either version 2
+  * of the License, or (at your option) any later version.
+  *
+  *  Copyright (C) 2005  wowie@pi.nxs.se
+  */
+
+ /*
+  * The kernel definitions aoeproto.h and aoeproto.c need, when they are
+  * built in userspace. Only what aoeproto.c actually uses belongs here.
+  */
+
+#ifndef AOESHIM_H
+#define AOESHIM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <linux/if_ether.h>	/* struct ethhdr, ETH_ALEN, ETH_HLEN */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+/* asm/byteorder.h */
+#define cpu_to_be16(x) htobe16(x)
+#define cpu_to_be32(x) htobe32(x)
+#define be16_to_cpu(x) be16toh(x)
+#define be32_to_cpu(x) be32toh(x)
+
+/* linux/hdreg.h, status and error bits */
+#define ERR_STAT	0x01
+#define WRERR_STAT	0x20
+#define READY_STAT	0x40
+#define ABRT_ERR	0x04
+#define IDNF_ERR	0x10
+#define ECC_ERR		0x40
+
+/* linux/hdreg.h, ata commands */
+#define WIN_READ	0x20
+#define WIN_READ_EXT	0x24
+#define WIN_WRITE	0x30
+#define WIN_WRITE_EXT	0x34
+#define WIN_IDENTIFY	0xEC
+#define WIN_FLUSH_CACHE	0xE7
+#define WIN_FLUSH_CACHE_EXT 0xEA
+
+#endif /* AOESHIM_H */
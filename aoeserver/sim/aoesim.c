@@ -0,0 +1,797 @@
+/*
+ *  sim/aoesim.c
+ *
+ * Userspace simulator for the ATA over Ethernet storage target.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * aoesim replays aoe requests against a memory or file backed target,
+ * running them through the same steps as the kernel module: the frames
+ * are queued like aoenet_rcv() does, a "kaoed pass" takes the queue in
+ * one go and for every request builds a reply (create_skb()), handles
+ * it (handleata() or handleconfig()) and sends the reply. The protocol
+ * work is done by aoeproto.c, which is shared with the module. Skbs, the
+ * kaoed queue and file io are replaced by simple shims, so the numbers
+ * show the cost of the request handling itself and not of the network
+ * or the kernel around it.
+ *
+ * Every step is timed, and the number of calls, ns per call and calls
+ * per second of each is printed when the run is done, together with how
+ * much memory the run took and how much of a file backed target ended up
+ * in the page cache. -D drops every transfer from the page cache right
+ * after it, writes are written out first, like bldev_dropbehind() does
+ * for files in the direct mode of the module. Block devices are
+ * submitted as bios in direct mode, which the simulator doesnt model.
+ *
+ * Flush requests and fua writes wait for a flush like in aoeflush.c:
+ * they are put on a list, and once the flush window (-w) has passed
+ * since the first of them joined it, one fdatasync() answers all of
+ * them. The list is looked at after every pass, the requests of a pass
+ * stand in for the ones that arrive while the flush work is busy. The
+ * flush still holds up the simulated kaoed, which in the module goes on
+ * with other requests. With -b 1 and no window every flush request gets
+ * its own fdatasync().
+ *
+ * -L times find_aoedevice() instead: looking up one of a number of
+ * devices by walking the device list, and through the shelf/slot hash of
+ * aoeproto_hash().
+ */
+
+#define _GNU_SOURCE	/* sync_file_range() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "aoesim.h"
+
+/* The steps we time */
+enum {
+	ST_KAOED,
+	ST_CREATE_SKB,
+	ST_HANDLEATA,
+	ST_HANDLECONFIG,
+	ST_FLUSH,
+	ST_MAX
+};
+
+static const char *sim_stages[ST_MAX] = {
+	[ST_KAOED] = "kaoed",
+	[ST_CREATE_SKB] = "create_skb",
+	[ST_HANDLEATA] = "handleata",
+	[ST_HANDLECONFIG] = "handleconfig",
+	[ST_FLUSH] = "flush",
+};
+
+static struct {
+	unsigned long calls;
+	u64 ns;
+} sim_time[ST_MAX];
+
+/* What came out of the replies */
+static struct {
+	unsigned long replies;
+	unsigned long errors;
+	unsigned long dropped;
+	unsigned long bad;	/* Read data that didnt match the target */
+	unsigned long commits;	/* Replies that waited for a flush */
+} sim_out;
+
+static int sim_verify;
+
+static inline u64 sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+#define SIM_TIME(stage, call)				\
+	do {						\
+		u64 __t = sim_now();			\
+		call;					\
+		sim_time[stage].ns += sim_now() - __t;	\
+		sim_time[stage].calls++;		\
+	} while (0)
+
+/* skb shim, the reply buffers are recycled like aoeskb.c does */
+
+static struct simskb *sim_skbpool;
+
+static struct simskb *sim_skb_alloc(void)
+{
+	struct simskb *skb = sim_skbpool;
+
+	if (skb)
+		sim_skbpool = skb->next;
+	else if ((skb = malloc(sizeof(*skb))) == NULL)
+		return (NULL);
+
+	skb->data = skb->buf + 64;	/* headroom */
+	skb->len = 0;
+	skb->size = SIM_MAXFRAME;
+
+	return (skb);
+}
+
+static void sim_skb_free(struct simskb *skb)
+{
+	skb->next = sim_skbpool;
+	sim_skbpool = skb;
+}
+
+static unsigned char *sim_skb_put(struct simskb *skb, unsigned int len)
+{
+	unsigned char *p = skb->data + skb->len;
+
+	if (skb->len + len > skb->size) {
+		fprintf(stderr, "sim_skb_put: over panic\n");
+		abort();
+	}
+
+	skb->len += len;
+	return (p);
+}
+
+/* file io shim */
+
+/* bldev_dropbehind(), a transfer of len bytes at off has gone through
+ * the page cache of a target in direct mode, write it out if it was a
+ * write and drop every page it touched, partial ones included */
+static long sim_dropbehind(struct simtarget *t, unsigned int len, u64 off,
+			   int write)
+{
+	static long pagesize;
+	u64 start, end;
+
+	if (!t->direct || len == 0)
+		return (0);
+
+	if (write && sync_file_range(t->fd, off, len,
+				     SYNC_FILE_RANGE_WAIT_BEFORE |
+				     SYNC_FILE_RANGE_WRITE |
+				     SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+		return (-errno);
+
+	if (pagesize == 0)
+		pagesize = sysconf(_SC_PAGESIZE);
+	start = off / pagesize * pagesize;
+	end = (off + len + pagesize - 1) / pagesize * pagesize;
+	posix_fadvise(t->fd, start, end - start, POSIX_FADV_DONTNEED);
+
+	return (0);
+}
+
+static long sim_read(struct simtarget *t, void *buf, unsigned int len,
+		     u64 off)
+{
+	if (t->mem) {
+		memcpy(buf, t->mem + off, len);
+		return (len);
+	}
+
+	if (pread(t->fd, buf, len, off) < 0)
+		return (-errno);
+
+	sim_dropbehind(t, len, off, 0);
+	return (len);
+}
+
+static long sim_write(struct simtarget *t, const void *buf, unsigned int len,
+		      u64 off)
+{
+	long ret;
+
+	if (t->mem) {
+		memcpy(t->mem + off, buf, len);
+		return (len);
+	}
+
+	if (pwrite(t->fd, buf, len, off) < 0)
+		return (-errno);
+
+	ret = sim_dropbehind(t, len, off, 1);
+	return (ret < 0 ? ret : (long)len);
+}
+
+/* Send the reply, or drop the request if there is none */
+static void sim_xmit(struct simreq *r)
+{
+	struct aoe_atahdr *ata;
+	u64 off;
+
+	if (r->skb_rep) {
+		sim_out.replies++;
+		if (r->aoerep->ver_flags & AOE_FLAG_ERR)
+			sim_out.errors++;
+
+		if (r->aoereq->cmd == AOE_CMD_ATA) {
+			ata = r->atareply;
+			if (ata->cmdstat & ERR_STAT)
+				sim_out.errors++;
+			else if (sim_verify && r->t->mem &&
+				 aoeproto_rw(ata) == AOEPROTO_READ) {
+				off = aoeproto_lba(ata) * 512;
+				if (memcmp(ata + 1, r->t->mem + off,
+					   ata->nsect * 512) != 0)
+					sim_out.bad++;
+			}
+		}
+
+		sim_skb_free(r->skb_rep);
+	} else
+		sim_out.dropped++;
+
+	sim_skb_free(r->skb_req);
+	r->skb_req = r->skb_rep = NULL;
+}
+
+/* bldev_transfer() */
+static void sim_transfer(struct simreq *r)
+{
+	struct simtarget *t = r->t;
+	unsigned int len = r->atarequest->nsect * 512;
+	u64 off = aoeproto_lba(r->atarequest) * 512;
+	unsigned char *data;
+	long ret;
+
+	if (aoeproto_rw(r->atarequest) == AOEPROTO_READ) {
+		data = sim_skb_put(r->skb_rep, len);
+		ret = sim_read(t, data, len, off);
+		aoeproto_status(r->atareply, 0, ret, len);
+		return;
+	}
+
+	data = (unsigned char *)(r->atarequest + 1);
+	if (data + len > r->skb_req->data + r->skb_req->len)
+		ret = -EINVAL;	/* The frame is short */
+	else
+		ret = sim_write(t, data, len, off);
+
+	/* A fua write is answered after the flush */
+	if (aoeproto_status(r->atareply, 1, ret, len) == 0 &&
+	    aoeproto_fua(r->atarequest))
+		r->commit = 1;
+}
+
+/* handleata() */
+static void sim_handleata(struct simreq *r)
+{
+	struct simtarget *t = r->t;
+
+	sim_skb_put(r->skb_rep, sizeof(struct aoe_atahdr));
+	r->atarequest = (struct aoe_atahdr *)(r->aoereq + 1);
+	r->atareply = (struct aoe_atahdr *)(r->aoerep + 1);
+
+	switch (aoeproto_atacheck(r->atarequest, r->atareply,
+				  aoeproto_maxsect(t->mtu), t->size)) {
+	case AOEPROTO_READ:
+	case AOEPROTO_WRITE:
+		sim_transfer(r);
+		break;
+
+	case AOEPROTO_IDENTIFY:
+		aoeproto_idreply(sim_skb_put(r->skb_rep, 512), t->id,
+				 aoeproto_maxsect(t->mtu));
+		break;
+
+	case AOEPROTO_FLUSH:
+		r->commit = 1;
+		break;
+	}
+}
+
+/* handleconfig() */
+static void sim_handleconfig(struct simreq *r)
+{
+	struct simtarget *t = r->t;
+	struct aoe_cfghdr *request = (struct aoe_cfghdr *)(r->aoereq + 1);
+	unsigned int avail, len;
+	int ret;
+
+	avail = r->skb_req->len - sizeof(struct aoe_hdr) -
+	    sizeof(struct aoe_cfghdr);
+
+	ret = aoeproto_cfg(&t->cfg, &t->cfg_len, r->aoerep, request, avail);
+	if (ret == AOEPROTO_NOREPLY) {
+		sim_skb_free(r->skb_rep);
+		r->skb_rep = NULL;
+		return;
+	}
+
+	if (ret == AOEPROTO_CHANGED)
+		aoeproto_buildcfg(&t->cfg, t->cfg_len, t->qdepth);
+
+	len = aoeproto_cfgreply((struct aoe_cfghdr *)(r->aoerep + 1), &t->cfg,
+				t->cfg_len, request->aoever_cmd & 0x0f,
+				aoeproto_maxsect(t->mtu));
+	sim_skb_put(r->skb_rep, len);
+}
+
+/* create_skb() */
+static struct simskb *sim_create_skb(struct simreq *r)
+{
+	struct simtarget *t = r->t;
+
+	if (aoeproto_replen(r->aoereq, aoeproto_maxsect(t->mtu), t->size) >
+	    SIM_MAXFRAME)
+		return (NULL);
+
+	if ((r->skb_rep = sim_skb_alloc()) == NULL)
+		return (NULL);
+
+	r->aoerep = (struct aoe_hdr *)sim_skb_put(r->skb_rep,
+						  sizeof(struct aoe_hdr));
+	aoeproto_rephdr(r->aoerep, r->aoereq, t->addr, t->shelf, t->slot);
+
+	return (r->skb_rep);
+}
+
+/* kaoed() */
+static void sim_kaoed(struct simreq *r)
+{
+	r->aoereq = (struct aoe_hdr *)r->skb_req->data;
+
+	SIM_TIME(ST_CREATE_SKB, sim_create_skb(r));
+	if (r->skb_rep == NULL) {
+		sim_xmit(r);
+		return;
+	}
+
+	switch (r->aoereq->cmd) {
+	case AOE_CMD_ATA:
+		SIM_TIME(ST_HANDLEATA, sim_handleata(r));
+		break;
+
+	case AOE_CMD_CFG:
+		SIM_TIME(ST_HANDLECONFIG, sim_handleconfig(r));
+		break;
+
+	default:
+		r->aoerep->ver_flags |= AOE_FLAG_ERR;
+		r->aoerep->error = AOE_ERR_BADCMD;
+		break;
+	}
+
+	if (!r->commit)
+		sim_xmit(r);
+}
+
+/* The requests waiting for the next flush, see aoeflush.c */
+static struct {
+	struct simreq *req;
+	int n, max;
+	u64 start;		/* When the first of them joined */
+	u64 window;		/* ns */
+} sim_fl;
+
+/* aoeflush_request(), the request joins the next flush */
+static int sim_flushreq(struct simreq *r)
+{
+	struct simreq *req;
+
+	if (sim_fl.n == sim_fl.max) {
+		req = realloc(sim_fl.req, (sim_fl.max * 2 + 16) * sizeof(*req));
+		if (req == NULL)
+			return (-1);
+		sim_fl.req = req;
+		sim_fl.max = sim_fl.max * 2 + 16;
+	}
+
+	if (sim_fl.n == 0)
+		sim_fl.start = sim_now();
+	sim_fl.req[sim_fl.n++] = *r;
+
+	return (0);
+}
+
+/* aoeflush_work(), one flush for every request that is waiting, once
+ * the window is over. The end of the run doesnt wait for it. */
+static void sim_flush(struct simtarget *t, int force)
+{
+	int i, ret;
+
+	if (sim_fl.n == 0)
+		return;
+	if (!force && sim_now() - sim_fl.start < sim_fl.window)
+		return;
+
+	SIM_TIME(ST_FLUSH, ret = t->fd >= 0 ? fdatasync(t->fd) : 0);
+	if (ret < 0)
+		ret = -errno;
+
+	for (i = 0; i < sim_fl.n; i++) {
+		if (ret < 0)
+			aoeproto_status(sim_fl.req[i].atareply, 1, ret, 0);
+		sim_out.commits++;
+		sim_xmit(&sim_fl.req[i]);
+	}
+	sim_fl.n = 0;
+}
+
+/* Set up the target, memory backed unless a file is given. A file
+ * smaller than size sectors is extended, and dropped from the page cache
+ * so that every run starts out cold. */
+static int sim_target(struct simtarget *t, const char *path, u64 size,
+		      int direct)
+{
+	struct stat st;
+
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+	t->qdepth = 16;
+	t->mtu = 9000;
+	memcpy(t->addr, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+
+	if (path) {
+		if ((t->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 ||
+		    fstat(t->fd, &st) < 0) {
+			perror(path);
+			return (-1);
+		}
+		if ((u64)st.st_size < size * 512 &&
+		    ftruncate(t->fd, size * 512) < 0) {
+			perror(path);
+			return (-1);
+		}
+		if ((u64)st.st_size > size * 512)
+			size = st.st_size / 512;
+
+		fdatasync(t->fd);
+		posix_fadvise(t->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+		/* Read-ahead is off in direct mode. Without it the page
+		 * cache also uses single pages, which can be dropped one by
+		 * one like the module does. */
+		t->direct = direct;
+		if (direct)
+			posix_fadvise(t->fd, 0, 0, POSIX_FADV_RANDOM);
+	} else if ((t->mem = calloc(size, 512)) == NULL) {
+		perror("calloc");
+		return (-1);
+	}
+
+	t->size = size;
+
+	strcpy((char *)t->cfg.data, "aoesim");
+	t->cfg_len = strlen("aoesim");
+	aoeproto_buildcfg(&t->cfg, t->cfg_len, t->qdepth);
+	aoeproto_buildid(t->id, t->size, "aoesim", 0);
+
+	return (0);
+}
+
+/* Move a generated read or write on by shift sectors, so that replaying
+ * the same frames over and over still covers the whole target */
+static void sim_shift(struct simskb *skb, u64 shift, u64 size)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)skb->data;
+	struct aoe_atahdr *ata = (struct aoe_atahdr *)(h + 1);
+	u64 lba;
+	int i;
+
+	if (h->cmd != AOE_CMD_ATA || ata->nsect == 0 || ata->nsect > size)
+		return;
+
+	switch (aoeproto_rw(ata)) {
+	case AOEPROTO_READ:
+	case AOEPROTO_WRITE:
+		break;
+	default:
+		return;
+	}
+
+	lba = (aoeproto_lba(ata) + shift) % (size - ata->nsect + 1);
+	for (i = 0; i < 6; i++)
+		ata->lba[i] = lba >> (i * 8);
+}
+
+/* How many kilobytes of a file backed target are in the page cache */
+static long sim_cached(struct simtarget *t)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	size_t len = t->size * 512, pages, i;
+	unsigned char *vec;
+	void *map;
+	long n = 0;
+
+	if (t->fd < 0)
+		return (0);
+
+	pages = (len + pagesize - 1) / pagesize;
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, t->fd, 0);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	if ((vec = malloc(pages)) != NULL && mincore(map, len, vec) == 0)
+		for (i = 0; i < pages; i++)
+			n += vec[i] & 1;
+	else
+		n = -1;
+
+	free(vec);
+	munmap(map, len);
+
+	return (n < 0 ? -1 : n * (pagesize / 1024));
+}
+
+/* find_aoedevice(), walking the list of all devices */
+static struct simdev *sim_findlist(struct simdev *list, u16 shelf, u8 slot,
+				   int ifindex)
+{
+	struct simdev *d;
+
+	for (d = list; d; d = d->next)
+		if (d->shelf == shelf && d->slot == slot &&
+		    (d->ifindex == ifindex || d->ifindex == 0 || ifindex == 0))
+			return (d);
+
+	return (NULL);
+}
+
+/* find_aoedevice(), through the shelf/slot hash */
+static struct simdev *sim_findhash(struct simdev **hash, u16 shelf, u8 slot,
+				   int ifindex)
+{
+	struct simdev *d;
+
+	for (d = hash[aoeproto_hash(shelf, slot)]; d; d = d->hnext)
+		if (d->shelf == shelf && d->slot == slot &&
+		    (d->ifindex == ifindex || d->ifindex == 0 || ifindex == 0))
+			return (d);
+
+	return (NULL);
+}
+
+/* Time n lookups of random devices among ndev, exported as e0.0 to
+ * eX.15 like aoeblock_register() would, both ways. A lookup is a few ns,
+ * so the loops are timed as a whole rather than with SIM_TIME(). */
+static int sim_lookup(int ndev, unsigned long n)
+{
+	struct simdev *hash[AOE_HASH_SIZE], *list = NULL, **devs, *d;
+	unsigned int *keys, nkeys = 8192;
+	unsigned long i, found[2] = { 0, 0 };
+	u64 t[3];
+	int j;
+
+	memset(hash, 0, sizeof(hash));
+	devs = calloc(ndev, sizeof(*devs));
+	keys = malloc(nkeys * sizeof(*keys));
+	if (devs == NULL || keys == NULL)
+		return (-1);
+
+	for (j = 0; j < ndev; j++) {
+		if ((d = devs[j] = calloc(1, sizeof(*d))) == NULL)
+			return (-1);
+		d->shelf = j / 16;
+		d->slot = j % 16;
+		d->next = list;
+		list = d;
+		d->hnext = hash[aoeproto_hash(d->shelf, d->slot)];
+		hash[aoeproto_hash(d->shelf, d->slot)] = d;
+	}
+
+	srand(1);
+	for (i = 0; i < nkeys; i++)
+		keys[i] = rand() % ndev;
+
+	t[0] = sim_now();
+	for (i = 0; i < n; i++) {
+		d = devs[keys[i % nkeys]];
+		found[0] += sim_findlist(list, d->shelf, d->slot, 1) != NULL;
+	}
+	t[1] = sim_now();
+	for (i = 0; i < n; i++) {
+		d = devs[keys[i % nkeys]];
+		found[1] += sim_findhash(hash, d->shelf, d->slot, 1) != NULL;
+	}
+	t[2] = sim_now();
+
+	printf("lookup      %d devices, %lu lookups, list %.1f ns, "
+	       "hash %.1f ns\n", ndev, n, (double)(t[1] - t[0]) / n,
+	       (double)(t[2] - t[1]) / n);
+	if (found[0] != n || found[1] != n)
+		printf("lookup      missed %lu list, %lu hash\n",
+		       n - found[0], n - found[1]);
+
+	for (j = 0; j < ndev; j++)
+		free(devs[j]);
+	free(devs);
+	free(keys);
+
+	return (0);
+}
+
+static void usage(int ret)
+{
+	fprintf(stderr,
+		"usage: aoesim [options]\n"
+		"  -n frames    number of frames to handle (default 1000000)\n"
+		"  -m MB        size of the target (default 64)\n"
+		"  -f file      back the target with a file instead of memory\n"
+		"  -D           drop the file from the page cache after each\n"
+		"               transfer, like direct mode does for files\n"
+		"  -M mtu       mtu of the simulated interface (default 9000)\n"
+		"  -s sectors   sectors per read and write (default max for mtu)\n"
+		"  -r percent   reads (default 70)\n"
+		"  -c percent   config queries (default 0)\n"
+		"  -i percent   identify requests (default 0)\n"
+		"  -F percent   flush requests (default 0), the rest write\n"
+		"  -U           fua writes\n"
+		"  -S           sequential instead of random lbas\n"
+		"  -b batch     requests handled per kaoed pass (default 16)\n"
+		"  -w usecs     flush window (default 0)\n"
+		"  -p file      replay the aoe requests in a pcap file instead\n"
+		"  -V           check the data of read replies\n"
+		"  -L devices   time the device lookup for this many devices\n"
+		"  -h           show this\n");
+	exit(ret);
+}
+
+int main(int argc, char **argv)
+{
+	struct simtarget t;
+	struct simgen g;
+	struct simframes f;
+	struct simreq *batch;
+	const char *file = NULL, *pcap = NULL;
+	unsigned long frames = 1000000, done, i;
+	unsigned int mtu = 9000;
+	u64 mb = 64, start, elapsed;
+	int nbatch = 16, direct = 0, lookup = 0, n, c;
+	struct rusage ru;
+	long cached;
+
+	memset(&g, 0, sizeof(g));
+	g.reads = 70;
+	g.nsect = -1;
+
+	while ((c = getopt(argc, argv, "n:m:f:DM:s:r:c:i:F:USb:w:p:VL:h")) != -1) {
+		switch (c) {
+		case 'n': frames = strtoul(optarg, NULL, 0); break;
+		case 'm': mb = strtoull(optarg, NULL, 0); break;
+		case 'f': file = optarg; break;
+		case 'D': direct = 1; break;
+		case 'M': mtu = strtoul(optarg, NULL, 0); break;
+		case 's': g.nsect = atoi(optarg); break;
+		case 'r': g.reads = atoi(optarg); break;
+		case 'c': g.configs = atoi(optarg); break;
+		case 'i': g.identifies = atoi(optarg); break;
+		case 'F': g.flushes = atoi(optarg); break;
+		case 'U': g.fua = 1; break;
+		case 'S': g.sequential = 1; break;
+		case 'b': nbatch = atoi(optarg); break;
+		case 'w': sim_fl.window = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'p': pcap = optarg; break;
+		case 'V': sim_verify = 1; break;
+		case 'L': lookup = atoi(optarg); break;
+		case 'h': usage(0);
+		default: usage(1);
+		}
+	}
+
+	if (nbatch < 1 || mb < 1 || mtu < 576 || mtu > 9000 ||
+	    (direct && file == NULL) || lookup < 0 || lookup > 65536 * 16)
+		usage(1);
+
+	if (lookup)
+		return (sim_lookup(lookup, frames) != 0);
+
+	if (sim_target(&t, file, mb * 2048, direct) != 0)
+		return (1);
+	t.mtu = mtu;
+
+	if (g.nsect < 0)
+		g.nsect = aoeproto_maxsect(mtu);
+
+	if (pcap) {
+		if (simgen_pcap(pcap, &f) != 0)
+			return (1);
+		if (f.count == 0) {
+			fprintf(stderr, "%s: no aoe requests\n", pcap);
+			return (1);
+		}
+		/* Answer as whatever device the capture talks to */
+		t.shelf = be16_to_cpu(((struct aoe_hdr *)f.frame[0])->shelf);
+		t.slot = ((struct aoe_hdr *)f.frame[0])->slot;
+	} else {
+		g.frames = frames < 8192 ? frames : 8192;
+		g.size = t.size;
+		if (simgen_build(&g, &f) != 0) {
+			fprintf(stderr, "aoesim: out of memory\n");
+			return (1);
+		}
+	}
+
+	if ((batch = calloc(nbatch, sizeof(*batch))) == NULL)
+		return (1);
+
+	start = sim_now();
+
+	for (done = 0; done < frames; done += n) {
+		/* aoenet_rcv(), the driver hands us a copy of the frame */
+		for (n = 0; n < nbatch && done + n < frames; n++) {
+			i = (done + n) % f.count;
+			batch[n].t = &t;
+			batch[n].skb_rep = NULL;
+			batch[n].commit = 0;
+			if ((batch[n].skb_req = sim_skb_alloc()) == NULL)
+				return (1);
+			memcpy(sim_skb_put(batch[n].skb_req, f.len[i]),
+			       f.frame[i], f.len[i]);
+			if (!pcap)
+				sim_shift(batch[n].skb_req, (done + n) /
+					  f.count * f.count * g.nsect, t.size);
+		}
+
+		/* One pass of kaoed */
+		for (c = 0; c < n; c++) {
+			SIM_TIME(ST_KAOED, sim_kaoed(&batch[c]));
+			if (batch[c].commit && sim_flushreq(&batch[c]) != 0)
+				return (1);
+		}
+		sim_flush(&t, 0);
+	}
+	sim_flush(&t, 1);
+
+	elapsed = sim_now() - start;
+
+	cached = sim_cached(&t);
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("target      %s%s, %llu sectors, mtu %u, %d sectors/frame\n",
+	       file ? file : "memory", direct ? " (direct)" : "",
+	       (unsigned long long)t.size, t.mtu, aoeproto_maxsect(t.mtu));
+	printf("traffic     %s, %lu distinct frames\n",
+	       pcap ? pcap : "generated", f.count);
+	printf("frames      %lu in %.3f s, %.0f frames/s, %.1f ns/frame\n",
+	       frames, elapsed / 1e9, frames / (elapsed / 1e9),
+	       (double)elapsed / frames);
+	printf("replies     %lu, %lu errors, %lu dropped", sim_out.replies,
+	       sim_out.errors, sim_out.dropped);
+	if (sim_verify)
+		printf(", %lu bad reads", sim_out.bad);
+	printf("\n");
+	if (sim_out.commits)
+		printf("flushes     %lu requests waited for %lu flushes, "
+		       "%llu us window\n", sim_out.commits,
+		       sim_time[ST_FLUSH].calls,
+		       (unsigned long long)sim_fl.window / 1000);
+	printf("memory      %ld kB max rss", ru.ru_maxrss);
+	if (file)
+		printf(", %ld kB of the target in the page cache", cached);
+	printf("\n\n");
+
+	printf("%-14s %12s %12s %14s\n", "step", "calls", "ns/call",
+	       "calls/s");
+	for (c = 0; c < ST_MAX; c++) {
+		double ns = sim_time[c].calls ?
+		    (double)sim_time[c].ns / sim_time[c].calls : 0;
+
+		printf("%-14s %12lu %12.1f %14.0f\n", sim_stages[c],
+		       sim_time[c].calls, ns, ns ? 1e9 / ns : 0);
+	}
+
+	simgen_free(&f);
+	free(batch);
+	free(sim_fl.req);
+
+	return (0);
+}
@@ -0,0 +1,108 @@
+/*
+ *  sim/aoesim.h
+ *
+ * Userspace simulator for the ATA over Ethernet storage target.
+ */
+
+ /*
+  * This program is free software; you can redistribute it and/or
+  * modify it under the terms of the GNU General Public License
+  * as published by the Free Software Foundation; either version 2
+  * of the License, or (at your option) any later version.
+  *
+  *  Copyright (C) 2005  wowie@pi.nxs.se
+  */
+
+ /*
+  * The simulator runs the request handling of the aoeserver module in a
+  * single process. The protocol code is the same aoeproto.c the module
+  * is built from, the kernel services around it (skbs, the kaoed queue
+  * and file io) are replaced by the shims in aoesim.c.
+  */
+
+#ifndef AOESIM_H
+#define AOESIM_H
+
+#include "aoeproto.h"
+
+/* Largest frame we generate or accept, a 9000 byte jumbo frame */
+#define SIM_MAXFRAME (9000 + ETH_HLEN)
+
+/* Stands in for struct sk_buff, a linear buffer with some headroom */
+struct simskb {
+	struct simskb *next;	/* Free list */
+	unsigned char *data;	/* Start of the frame */
+	unsigned int len;	/* Length of the frame */
+	unsigned int size;	/* Room after data */
+	unsigned char buf[64 + SIM_MAXFRAME];
+};
+
+/* Stands in for struct aoeblkdev */
+struct simtarget {
+	u16 shelf;
+	u8 slot;
+	u64 size;		/* Size in sectors */
+	unsigned char *mem;	/* Memory backed target, or */
+	int fd;			/* file backed target */
+	int direct;		/* Drop what went through the page cache */
+	int qdepth;
+	unsigned char addr[ETH_ALEN];	/* Our interface address */
+	unsigned int mtu;
+
+	struct aoe_cfgtmpl cfg;
+	u16 cfg_len;
+	u8 id[512];
+};
+
+/* Stands in for struct aoeblkdev in the lookup benchmark, on the list
+ * of all devices and in the shelf/slot hash */
+struct simdev {
+	struct simdev *next;
+	struct simdev *hnext;
+	u16 shelf;
+	u8 slot;
+	int ifindex;
+	unsigned char rest[2048];	/* Devices dont share cache lines */
+};
+
+/* Stands in for struct aoerequest */
+struct simreq {
+	struct simskb *skb_req;
+	struct simskb *skb_rep;
+	struct aoe_hdr *aoereq;
+	struct aoe_hdr *aoerep;
+	struct aoe_atahdr *atarequest;
+	struct aoe_atahdr *atareply;
+	struct simtarget *t;
+	int commit;		/* The reply waits for a flush */
+};
+
+/* Traffic to generate, see aoegen.c */
+struct simgen {
+	unsigned long frames;	/* Number of distinct frames */
+	int nsect;		/* Sectors per read and write */
+	int reads;		/* Percentage of reads, */
+	int configs;		/* config queries, */
+	int identifies;		/* identify requests, */
+	int flushes;		/* and flush requests, the rest are writes */
+	int fua;		/* Writes are fua writes */
+	int sequential;		/* Sequential rather than random lbas */
+	u16 shelf;
+	u8 slot;
+	u64 size;		/* Sectors to spread requests over */
+};
+
+/* A set of frames to replay */
+struct simframes {
+	unsigned long count;
+	unsigned int *len;
+	unsigned char **frame;
+};
+
+/* aoegen.c */
+int simgen_build(struct simgen *g, struct simframes *f);
+int simgen_pcap(const char *path, struct simframes *f);
+void simgen_free(struct simframes *f);
+/* end aoegen.c */
+
+#endif /* AOESIM_H */
@@ -0,0 +1,617 @@
+/*
+ *  tools/aoeload.c
+ *
+ * Load generator for ATA over Ethernet storage targets.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ *  Copyright (C) 2005  wowie@pi.nxs.se
+ */
+
+/*
+ * aoeload is a minimal aoe initiator that does nothing but keep targets
+ * busy. It talks to them over a raw packet socket, so the target can run
+ * on the same machine, on the other end of a veth pair:
+ *
+ *   ip link add aoe0 type veth peer name aoe1
+ *   ip link set aoe0 up; ip link set aoe1 up
+ *   echo add /dev/ram0 0 1 aoe0 > /proc/aoeserver
+ *   aoeload -i aoe1 -d 10
+ *
+ * The targets are found with a config query, either all targets on the
+ * network or the ones given with -t, and asked for their size with an
+ * identify request. Then every target gets a fixed number of requests
+ * (tags) in flight, a new request is sent as soon as one is answered.
+ * Requests that are not answered within the timeout are sent again,
+ * with the same tag. When the run is done the number of requests per
+ * second, the throughput, the number of retransmits and errors, and the
+ * latency percentiles are printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+#include "aoeshim.h"
+#include "aoeproto.h"
+
+#define MAXTARGETS	256
+#define MAXFRAME	(9000 + ETH_HLEN)
+
+/* Latency histogram, 1us resolution below 64us and 32 buckets for every
+ * power of two above that, about 3% accuracy up to 1000s */
+#define HIST_LINEAR	64
+#define HIST_SUB	32
+#define HIST_MAX	(HIST_LINEAR + 25 * HIST_SUB)
+
+struct target {
+	u16 shelf;
+	u8 slot;
+	u8 mac[ETH_ALEN];
+	int maxsect;		/* From the config reply */
+	int bufcnt;
+	u64 size;		/* Sectors, from the identify reply */
+	u64 next;		/* Next lba for sequential io */
+};
+
+/* A request in flight, the index in the tag table is the low 16 bits of
+ * the aoe tag and a generation count the upper 16 bits, so that late
+ * answers to an earlier request in the same slot are recognized */
+struct tagslot {
+	struct target *t;
+	u32 tag;
+	int active;
+	int write;
+	int nsect;
+	u64 lba;
+	u64 sent;		/* First sent */
+	u64 last;		/* Last (re)sent */
+};
+
+static struct target targets[MAXTARGETS];
+static int ntargets;
+static struct tagslot *tags;
+static int ntags;
+
+static int sock;
+static int ifindex;
+static u8 ifaddr[ETH_ALEN];
+static int ifmaxsect;
+
+static unsigned char txbuf[MAXFRAME];
+static unsigned char rxbuf[MAXFRAME];
+
+static struct {
+	unsigned long reads, writes;
+	unsigned long long bytes;
+	unsigned long retransmits;
+	unsigned long errors;
+	unsigned long stale;	/* Answers to requests already answered */
+	unsigned long hist[HIST_MAX];
+	u64 maxlat;
+} st;
+
+static int nsect = -1;
+static int reads = 70;
+static int sequential;
+static u64 timeout = 200 * 1000000ULL;
+
+static u64 now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static u64 rnd(void)
+{
+	static u64 x = 0x2545f4914f6cdd1dULL;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return (x);
+}
+
+static int hist_bucket(u64 us)
+{
+	int e = 63 - __builtin_clzll(us | 1);
+	int b;
+
+	if (us < HIST_LINEAR)
+		return (us);
+
+	b = HIST_LINEAR + (e - 6) * HIST_SUB + ((us >> (e - 5)) & (HIST_SUB - 1));
+	return (b < HIST_MAX ? b : HIST_MAX - 1);
+}
+
+/* Lower bound of a bucket, in microseconds */
+static u64 hist_value(int b)
+{
+	int e;
+
+	if (b < HIST_LINEAR)
+		return (b);
+
+	e = (b - HIST_LINEAR) / HIST_SUB + 6;
+	return ((1ULL << e) + ((u64)((b - HIST_LINEAR) % HIST_SUB) << (e - 5)));
+}
+
+static u64 hist_percentile(double p)
+{
+	unsigned long total = 0, want, sum = 0;
+	int b;
+
+	for (b = 0; b < HIST_MAX; b++)
+		total += st.hist[b];
+	if (total == 0)
+		return (0);
+
+	want = total * p / 100.0;
+	if (want >= total)
+		want = total - 1;
+
+	for (b = 0; b < HIST_MAX; b++) {
+		sum += st.hist[b];
+		if (sum > want)
+			break;
+	}
+
+	return (hist_value(b));
+}
+
+/* Start a request frame to dst, or broadcast if dst is NULL */
+static struct aoe_hdr *frame_hdr(const u8 *dst, u16 shelf, u8 slot, int cmd,
+				 u32 tag)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)txbuf;
+
+	if (dst)
+		memcpy(h->eth.h_dest, dst, ETH_ALEN);
+	else
+		memset(h->eth.h_dest, 0xff, ETH_ALEN);
+	memcpy(h->eth.h_source, ifaddr, ETH_ALEN);
+	h->eth.h_proto = htons(PRIV_ETH_P_AOE);
+	h->ver_flags = 0x10;	/* AOE Version one */
+	h->error = 0;
+	h->shelf = htons(shelf);
+	h->slot = slot;
+	h->cmd = cmd;
+	h->tag = htonl(tag);
+
+	return (h);
+}
+
+/* Short frames are padded with whatever follows in txbuf */
+static void frame_send(unsigned int len)
+{
+	if (len < ETH_ZLEN)
+		len = ETH_ZLEN;
+
+	if (send(sock, txbuf, len, 0) < 0)
+		perror("send");
+}
+
+/* Build and send the ata request of a tag */
+static void ata_send(struct tagslot *s)
+{
+	struct aoe_atahdr *ata;
+	unsigned int len;
+	int i;
+
+	frame_hdr(s->t->mac, s->t->shelf, s->t->slot, AOE_CMD_ATA, s->tag);
+	ata = (struct aoe_atahdr *)(txbuf + sizeof(struct aoe_hdr));
+	memset(ata, 0, sizeof(*ata));
+
+	ata->flags = AOE_ATAFLAG_LBA48;
+	ata->nsect = s->nsect;
+	ata->cmdstat = s->write ? WIN_WRITE_EXT : WIN_READ_EXT;
+	for (i = 0; i < 6; i++)
+		ata->lba[i] = s->lba >> (i * 8);
+
+	len = sizeof(struct aoe_hdr) + sizeof(struct aoe_atahdr);
+	if (s->write) {
+		ata->flags |= AOE_ATAFLAG_WRITE;
+		len += s->nsect * 512;	/* Whatever is in txbuf */
+	}
+
+	s->last = now();
+	frame_send(len);
+}
+
+/* Pick the next request for a tag and send it */
+static void tag_start(struct tagslot *s)
+{
+	struct target *t = s->t;
+	u64 span;
+
+	s->nsect = nsect < t->maxsect ? nsect : t->maxsect;
+	span = t->size > (u64)s->nsect ? t->size - s->nsect : 1;
+
+	if (sequential) {
+		s->lba = t->next;
+		t->next = (t->next + s->nsect) % span;
+	} else
+		s->lba = rnd() % span;
+
+	s->write = (int)(rnd() % 100) >= reads;
+	s->tag = (s->tag + 0x10000) & 0xffff0000;
+	s->tag |= s - tags;
+	s->active = 1;
+	s->sent = now();
+
+	ata_send(s);
+}
+
+/* Read one frame if there is one, returns its length or 0 */
+static int frame_recv(int wait_ms)
+{
+	struct pollfd p = { .fd = sock, .events = POLLIN };
+	struct aoe_hdr *h = (struct aoe_hdr *)rxbuf;
+	int len;
+
+	for (;;) {
+		len = recv(sock, rxbuf, sizeof(rxbuf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (wait_ms <= 0 || poll(&p, 1, wait_ms) <= 0)
+				return (0);
+			wait_ms = 0;
+			continue;
+		}
+
+		/* Answers only, we see our own requests on some interfaces */
+		if (len >= (int)sizeof(*h) && (h->ver_flags & AOE_FLAG_RSP))
+			return (len);
+	}
+}
+
+static void ata_done(int len)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)rxbuf;
+	struct aoe_atahdr *ata = (struct aoe_atahdr *)(h + 1);
+	u32 tag = ntohl(h->tag);
+	struct tagslot *s;
+	u64 lat;
+
+	if (h->cmd != AOE_CMD_ATA || (tag & 0xffff) >= (u32)ntags)
+		return;
+
+	s = &tags[tag & 0xffff];
+	if (!s->active || s->tag != tag) {
+		st.stale++;
+		return;
+	}
+
+	if ((h->ver_flags & AOE_FLAG_ERR) ||
+	    len < (int)(sizeof(*h) + sizeof(*ata)) || (ata->cmdstat & ERR_STAT))
+		st.errors++;
+	else {
+		if (s->write)
+			st.writes++;
+		else
+			st.reads++;
+		st.bytes += s->nsect * 512;
+	}
+
+	lat = now() - s->sent;
+	st.hist[hist_bucket(lat / 1000)]++;
+	if (lat > st.maxlat)
+		st.maxlat = lat;
+
+	s->active = 0;
+}
+
+/* Broadcast a config read query */
+static void cfg_query(u16 shelf, u8 slot)
+{
+	struct aoe_hdr *h = frame_hdr(NULL, shelf, slot, AOE_CMD_CFG, 0);
+
+	memset(h + 1, 0, sizeof(struct aoe_cfghdr));
+	frame_send(sizeof(struct aoe_hdr) + sizeof(struct aoe_cfghdr));
+}
+
+/* Find the targets with a config query, to all targets on the network if
+ * none were given or to each of the given ones */
+static int discover(int all)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)rxbuf;
+	struct aoe_cfghdr *cfg = (struct aoe_cfghdr *)(h + 1);
+	struct target *t;
+	int found = 0, i, len;
+	u64 end;
+
+	if (all)
+		cfg_query(0xffff, 0xff);
+	else
+		for (i = 0; i < ntargets; i++)
+			cfg_query(targets[i].shelf, targets[i].slot);
+
+	end = now() + 1000000000ULL;
+	while (now() < end) {
+		if ((len = frame_recv(100)) == 0)
+			continue;
+		if (h->cmd != AOE_CMD_CFG || (h->ver_flags & AOE_FLAG_ERR) ||
+		    len < (int)(sizeof(*h) + sizeof(*cfg)))
+			continue;
+
+		for (t = NULL, i = 0; i < ntargets; i++)
+			if (targets[i].shelf == ntohs(h->shelf) &&
+			    targets[i].slot == h->slot)
+				t = &targets[i];
+
+		if (t == NULL) {
+			if (!all || ntargets == MAXTARGETS)
+				continue;
+			t = &targets[ntargets++];
+			t->shelf = ntohs(h->shelf);
+			t->slot = h->slot;
+		} else if (t->maxsect)
+			continue;	/* Answered on another interface */
+
+		memcpy(t->mac, h->eth.h_source, ETH_ALEN);
+		t->maxsect = cfg->scnt ? cfg->scnt : 2;
+		if (t->maxsect > ifmaxsect)
+			t->maxsect = ifmaxsect;
+		t->bufcnt = ntohs(cfg->queuelen);
+		found++;
+	}
+
+	return (found);
+}
+
+/* Ask every target for its size */
+static int identify(void)
+{
+	struct aoe_hdr *h = (struct aoe_hdr *)rxbuf;
+	struct aoe_atahdr *ata;
+	u8 *id = rxbuf + sizeof(struct aoe_hdr) + sizeof(struct aoe_atahdr);
+	int i, j, len, missing;
+	u64 end, size;
+
+	for (i = 0; i < ntargets; i++) {
+		if (targets[i].maxsect == 0)
+			continue;
+		frame_hdr(targets[i].mac, targets[i].shelf, targets[i].slot,
+			  AOE_CMD_ATA, i);
+		ata = (struct aoe_atahdr *)(txbuf + sizeof(struct aoe_hdr));
+		memset(ata, 0, sizeof(*ata));
+		ata->nsect = 1;
+		ata->cmdstat = WIN_IDENTIFY;
+		frame_send(sizeof(struct aoe_hdr) + sizeof(*ata));
+	}
+
+	end = now() + 1000000000ULL;
+	while (now() < end) {
+		if ((len = frame_recv(100)) == 0)
+			continue;
+		i = ntohl(h->tag);
+		if (h->cmd != AOE_CMD_ATA || i >= ntargets ||
+		    (h->ver_flags & AOE_FLAG_ERR) ||
+		    len < (int)(sizeof(*h) + sizeof(*ata) + 512))
+			continue;
+
+		/* lba_capacity_2, words 100 to 103 */
+		for (size = 0, j = 3; j >= 0; j--)
+			size = (size << 16) | id[200 + j * 2] |
+			    (id[201 + j * 2] << 8);
+		if (size == 0)	/* lba_capacity, words 60 and 61 */
+			size = id[120] | (id[121] << 8) | (id[122] << 16) |
+			    ((u32)id[123] << 24);
+		targets[i].size = size;
+	}
+
+	for (missing = 0, i = 0; i < ntargets; i++)
+		if (targets[i].size == 0) {
+			fprintf(stderr, "e%d.%d: no answer, skipped\n",
+				targets[i].shelf, targets[i].slot);
+			missing++;
+		}
+
+	return (ntargets - missing);
+}
+
+static int open_if(const char *name)
+{
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+
+	if ((sock = socket(AF_PACKET, SOCK_RAW, htons(PRIV_ETH_P_AOE))) < 0) {
+		perror("socket");
+		return (-1);
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+		perror(name);
+		return (-1);
+	}
+	ifindex = ifr.ifr_ifindex;
+
+	if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0) {
+		perror(name);
+		return (-1);
+	}
+	memcpy(ifaddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	if (ioctl(sock, SIOCGIFMTU, &ifr) < 0) {
+		perror(name);
+		return (-1);
+	}
+	ifmaxsect = aoeproto_maxsect(ifr.ifr_mtu);
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(PRIV_ETH_P_AOE);
+	sll.sll_ifindex = ifindex;
+	if (bind(sock, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		perror("bind");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Parse a list of targets, shelf.slot[,shelf.slot...] */
+static int parse_targets(char *list)
+{
+	char *p;
+	unsigned int shelf, slot;
+
+	for (p = strtok(list, ","); p; p = strtok(NULL, ",")) {
+		if (sscanf(p, "%u.%u", &shelf, &slot) != 2 || shelf >= 0xffff ||
+		    slot >= 0xff || ntargets == MAXTARGETS)
+			return (-1);
+		targets[ntargets].shelf = shelf;
+		targets[ntargets].slot = slot;
+		ntargets++;
+	}
+
+	return (0);
+}
+
+static void report(u64 elapsed)
+{
+	double secs = elapsed / 1e9;
+	unsigned long ios = st.reads + st.writes;
+
+	printf("requests    %lu reads, %lu writes in %.2f s\n", st.reads,
+	       st.writes, secs);
+	printf("iops        %.0f\n", ios / secs);
+	printf("throughput  %.1f MB/s\n", st.bytes / secs / (1024 * 1024));
+	printf("retransmits %lu\n", st.retransmits);
+	printf("errors      %lu\n", st.errors);
+	printf("late        %lu\n", st.stale);
+	printf("latency us  p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, "
+	       "max %llu\n",
+	       (unsigned long long)hist_percentile(50),
+	       (unsigned long long)hist_percentile(90),
+	       (unsigned long long)hist_percentile(99),
+	       (unsigned long long)hist_percentile(99.9),
+	       (unsigned long long)st.maxlat / 1000);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: aoeload -i interface [options]\n"
+		"  -t shelf.slot,...  targets to load (default all found)\n"
+		"  -d seconds         length of the run (default 10)\n"
+		"  -q tags            requests in flight per target "
+		"(default 16)\n"
+		"  -s sectors         sectors per request (default max)\n"
+		"  -r percent         reads (default 70), the rest write\n"
+		"  -S                 sequential instead of random lbas\n"
+		"  -T ms              retransmit timeout (default 200)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *ifname = NULL;
+	char *list = NULL;
+	int seconds = 10, qdepth = 16;
+	int c, i, j, len;
+	u64 start, end, t;
+
+	while ((c = getopt(argc, argv, "i:t:d:q:s:r:ST:")) != -1) {
+		switch (c) {
+		case 'i': ifname = optarg; break;
+		case 't': list = optarg; break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'q': qdepth = atoi(optarg); break;
+		case 's': nsect = atoi(optarg); break;
+		case 'r': reads = atoi(optarg); break;
+		case 'S': sequential = 1; break;
+		case 'T': timeout = strtoull(optarg, NULL, 0) * 1000000ULL; break;
+		default: usage();
+		}
+	}
+
+	if (ifname == NULL || seconds < 1 || qdepth < 1 || timeout == 0)
+		usage();
+	if (list && parse_targets(list) != 0)
+		usage();
+	if (open_if(ifname) != 0)
+		return (1);
+	if (nsect < 1 || nsect > ifmaxsect)
+		nsect = ifmaxsect;
+
+	if (discover(list == NULL) == 0) {
+		fprintf(stderr, "%s: no targets found\n", ifname);
+		return (1);
+	}
+
+	/* Drop the targets we know nothing about */
+	identify();
+	for (i = j = 0; i < ntargets; i++)
+		if (targets[i].size)
+			targets[j++] = targets[i];
+	ntargets = j;
+	if (ntargets == 0)
+		return (1);
+
+	for (i = 0; i < ntargets; i++)
+		printf("e%d.%d  %llu sectors, %d sectors/request, bufcnt %d\n",
+		       targets[i].shelf, targets[i].slot,
+		       (unsigned long long)targets[i].size,
+		       nsect < targets[i].maxsect ? nsect : targets[i].maxsect,
+		       targets[i].bufcnt);
+
+	if (ntargets * qdepth > 0xffff) {
+		fprintf(stderr, "too many tags in flight\n");
+		return (1);
+	}
+	ntags = ntargets * qdepth;
+	if ((tags = calloc(ntags, sizeof(*tags))) == NULL)
+		return (1);
+	for (i = 0; i < ntags; i++)
+		tags[i].t = &targets[i / qdepth];
+
+	/* Write data, something that isnt all zeroes */
+	for (i = sizeof(struct aoe_hdr) + sizeof(struct aoe_atahdr);
+	     i < MAXFRAME; i++)
+		txbuf[i] = i;
+
+	start = now();
+	end = start + seconds * 1000000000ULL;
+
+	for (i = 0; i < ntags; i++)
+		tag_start(&tags[i]);
+
+	while ((t = now()) < end) {
+		while ((len = frame_recv(1)) > 0) {
+			ata_done(len);
+			if (now() >= end)
+				break;
+		}
+
+		for (i = 0; i < ntags; i++) {
+			if (!tags[i].active)
+				tag_start(&tags[i]);
+			else if (t - tags[i].last > timeout) {
+				st.retransmits++;
+				ata_send(&tags[i]);
+			}
+		}
+	}
+
+	report(now() - start);
+	close(sock);
+
+	return (0);
+}